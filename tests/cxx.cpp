@@ -0,0 +1,99 @@
+#include "utest.h"
+
+#include <deque>
+#include <list>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+struct point {
+    int x, y;
+    bool operator==(const point& o) const { return x == o.x && y == o.y; }
+};
+
+TEST(cxx_eq)
+{
+    std::vector<int> a = {1, 2, 3}, b = {1, 2, 3};
+    std::string s = "one";
+    char prefix[] = "ab";
+    const char* null = nullptr;
+    int calls = 0;
+
+    eq(1, 1);
+    eq((size_t)3, 3u);
+    eq(-1LL, -1);
+    eq(s, "one");
+    eq(prefix, "ab");
+    assert_not_eq(prefix, "abc");
+    assert_not_eq(null, "ab");
+    eq(null, nullptr);
+    eq(a, b);
+    eq((point{1, 2}), (point{1, 2}));
+    eq(0.1 + 0.2, 0.3);
+    assert_not_eq(1.0, 1.0 + 1e-9);
+    eq(calls++, 0);
+    eq(calls, 1);
+    assert_near(1.0, 1.05, 0.1);
+    eqn(a.data(), b.data(), a.size() * sizeof(int));
+
+    const char* words[] = {"b", "a"};
+    const char* sorted[] = {"a", "b"};
+    assert_unordered_eq(words, sorted, 2);
+}
+
+TEST(cxx_failures)
+{
+    UTestCase failing = {};
+    std::vector<int> a = {1, 2};
+    std::string s = "one";
+    int calls = 0;
+
+    failing.name = const_cast<char*>("failing");
+    CATCH_STDERR(errors) {
+        _current_test = &failing;
+        eq(calls + 40, 42);
+        eq(s, "two");
+        eq((point{1, 2}), (point{2, 1}));
+        eq(a.size(), 3);
+        _current_test = utest->test;
+    }
+    eq(failing.status, 4);
+    assert(strstr(errors, "'calls + 40 == 42'\n    left:  40\n    right: 42\n") != NULL);
+    assert(strstr(errors, "left:  \"one\"\n    right: \"two\"\n") != NULL);
+    assert(strstr(errors, "left:  \"<8 byte object>\"") != NULL);
+    assert(strstr(errors, "left:  2 (0x2)\n    right: 3 (0x3)\n") != NULL);
+}
+
+TEST(cxx_options, .setup = NULL, .ignore = 1)
+{
+    FAIL("ignored tests don't run");
+}
+
+typedef utest::types<std::vector<int>, std::deque<int>, std::list<int> > Sequences;
+
+TYPED_TEST(push_back, Sequences)
+{
+    TypeParam seq;
+    for (int i = 0; i < 100; i++)
+        seq.push_back(i);
+    eq(seq.size(), 100);
+    eq(seq.front(), 0);
+    eq(seq.back(), 99);
+    assert(strncmp(CURRENT_TEST_NAME, "push_back<std::", 15) == 0);
+}
+
+TEST(typed_tests_registered)
+{
+    eq(_utest_typed_count_push_back, 3);
+    eq(strcmp(utest::type_name<std::vector<int> >(), "std::vector<int>"), 0);
+    eq(strcmp(utest::type_name<unsigned int>(), "unsignedint"), 0);
+}
+
+BENCH(vector_push_back)
+{
+    for (size_t i = 0; i < utest->bench->n; i++) {
+        std::vector<int> v;
+        for (int j = 0; j < 64; j++)
+            v.push_back(j);
+    }
+}
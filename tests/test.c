@@ -344,6 +344,61 @@ TEST(struct_equals)
     not_eqn(&a, &b, sizeof(struct test));
 }
 
+TEST(generic_assertions)
+{
+    UTestCase failing = { .name = "failing" };
+    char prefix[] = "ab";
+    char* null = NULL;
+    double zero = 0.0;
+    int calls = 0;
+    char high = (char)200;
+    char high_left[32];
+
+    not_eq(prefix, "abc");
+    not_eq("abc", prefix);
+    eq(prefix, "ab");
+    not_eq(null, "ab");
+    eq(null, (char*)NULL);
+    eq(strcomp("ab", "abc"), 1);
+
+    eq((unsigned char)255, 255);
+    eq((short)-3, -3L);
+    eq((size_t)3, 3);
+    eq(-1LL, -1);
+    eq((void*)prefix, &prefix[0]);
+    eq(calls++, 0);
+    eq(calls, 1);
+
+    eq(0.1 + 0.2, 0.3);
+    eq(0.1f + 0.2f, 0.3f);
+    eq(0.0, -0.0);
+    eq(1.0L / 3, 1.0L - 2.0L / 3);
+    not_eq(1.0, 1.0 + 1e-9);
+    not_eq(-1.0f, 1.0f);
+    not_eq(zero / zero, zero / zero);
+    not_eq(1.0 / zero, 1.7976931348623157e308);
+    assert_near(1.0, 1.05, 0.1);
+
+    CATCH_STDERR(errors) {
+        _current_test = &failing;
+        eq(calls + 40, 42);
+        eq(1.5f, 1.25f);
+        eq(null, "two");
+        assert_near(1, 2, 0.5);
+        eq(high, (char)'a');
+        _current_test = utest->test;
+    }
+    eq(failing.status, 5);
+    assert(strstr(errors, "'calls + 40 == 42'\n    left:  41\n    right: 42\n") != NULL);
+    assert(strstr(errors, "left:  1.5\n    right: 1.25\n    2097152 ulps apart\n") != NULL);
+    assert(strstr(errors, "left:  NULL\n    right: \"two\"\n") != NULL);
+    assert(strstr(errors, "'1 ~= 2'") != NULL);
+    /* plain char keeps the sign it has on the target */
+    eq(_UTEST_KIND(high), CHAR_MIN < 0 ? UT_KIND_INT : UT_KIND_UINT);
+    snprintf(high_left, sizeof(high_left), "left:  %d\n", high);
+    assert(strstr(errors, high_left) != NULL);
+}
+
 TEST(output_capture_test, .ignore = 0)
 {
     {
@@ -355,7 +410,7 @@ TEST(output_capture_test, .ignore = 0)
         assert(buf != NULL);
         eq((int)len, 6);
         eqn(buf, "hello", 6);
-        free(buf);
+        utest_capture_free(buf);
     }
 
     {
@@ -373,7 +428,7 @@ TEST(output_capture_test, .ignore = 0)
         eq((int)len, 49);
         eq(len, sizeof(exp));
         eqn((char*)buf, (char*)exp, sizeof(exp));
-        free(buf);
+        utest_capture_free(buf);
     }
 
     {
@@ -384,7 +439,7 @@ TEST(output_capture_test, .ignore = 0)
             printf("output");
         }
         eq(output, "outputoutput");
-        free(output);
+        utest_capture_free(output);
     }
 }
 
@@ -407,37 +462,24 @@ TEST(capture_overflow) // to make sure that my buffers dont overflow when im cap
 }
 
 #include <unistd.h>
+#include <fcntl.h>
 
-size_t pipe_read_util(int fd, char** buffer);
-
-TEST(read_util_func)
+TEST(capture_large_output)
 {
-    int stdout_save = -1;
-    int outpipe[2] = {-1, -1};
-    fflush(stdout);
-    if ((stdout_save = dup(STDOUT_FILENO)) == -1) {
-        fprintf(stderr, "couldn't copy stdout\n");
-        exit(1);
-    }
-    if (pipe(outpipe) != 0)
-        fprintf(stderr, "couldn't create output capture pipe\n");
-    if (dup2(outpipe[1], STDOUT_FILENO) == -1)
-        fprintf(stderr, "couldn't rediect stdout to pipe\n");
+    const size_t size = 4 << 20;
 
-    printf("testing...");
-
-    fflush(stdout);
-    write(outpipe[1], "", 1);
-    close(outpipe[1]);
-    dup2(stdout_save, STDOUT_FILENO);
-
-    char* buffer = NULL;
-
-    eq((size_t)11, pipe_read_util(outpipe[0], &buffer));
-    eq(buffer, "testing...");
+    CATCH_OUTPUT(buf) {
+        for (size_t i = 0; i < size / 64; i++)
+            printf("%063zu\n", i);
+    }
+    eq(buf_length, size + 1);
+    eqn(buf, "000000000000000000000000000000000000000000000000000000000000000\n", 64);
+    eq(buf[size - 1], '\n');
+    eq(buf[size], '\0');
 
-    close(outpipe[0]);
-    free(buffer);
+    CATCH_OUTPUT(empty) {}
+    eq(empty_length, (size_t)1);
+    eq(empty, "");
 }
 
 TEST(arr_contains_test)
@@ -449,4 +491,1169 @@ TEST(arr_contains_test)
     for (int i = 0; i < (int)len; i++) {
         assert(str_arr_contains(keys, len, keys[i]));
     }
-}
\ No newline at end of file
+}
+static void forked_print(UTestRunner* utest __attribute__((unused)))
+{
+    printf("from a worker");
+}
+
+static void forked_fail(UTestRunner* utest __attribute__((unused)))
+{
+    _current_test->status += 1;
+}
+
+TEST(forked_runner)
+{
+    UTestCase cases[3] = {
+        { .test = forked_print, .name = "forked_print" },
+        { .test = forked_fail,  .name = "forked_fail" },
+        { .test = forked_print, .name = "forked_print_again" },
+    };
+    UTestCase* schedule[] = {&cases[0], &cases[1], &cases[2]};
+    int failed = 0;
+
+    CATCH_OUTPUT(output) {
+        failed = RunForked(schedule, 3, 2);
+    }
+    eq(failed, 1);
+    eq(output, "from a worker.xfrom a worker.");
+    eq(cases[0].status, 0);
+    eq(cases[1].status, 1);
+    eq(cases[2].status, 0);
+}
+
+static void crash_segv(UTestRunner* utest __attribute__((unused)))
+{
+    printf("before the crash");
+    fflush(stdout);
+    raise(SIGSEGV);
+}
+
+static void crash_abort(UTestRunner* utest)
+{
+    utest->fail("giving up\n");
+}
+
+TEST(crash_isolation)
+{
+    UTestCase cases[5] = {
+        { .test = forked_print, .name = "isolated_print" },
+        { .test = crash_segv,   .name = "isolated_segv" },
+        { .test = forked_print, .name = "isolated_print_again" },
+        { .test = crash_abort,  .name = "isolated_abort" },
+        { .test = forked_print, .name = "isolated_print_last" },
+    };
+    UTestCase* schedule[] = {&cases[0], &cases[1], &cases[2], &cases[3], &cases[4]};
+    int batch = Options.batch;
+    int failed = 0;
+
+    Options.batch = 2;
+    CATCH_STDERR(errors) {
+        CATCH_OUTPUT(output) {
+            failed = RunForked(schedule, 5, 1);
+        }
+        eq(output, "from a worker.before the crashxfrom a worker.xfrom a worker.");
+    }
+    Options.batch = batch;
+
+    eq(failed, 2);
+    eq(cases[1].status, 1);
+    eq(cases[3].status, 1);
+    eq(cases[4].status, 0);
+    assert(strstr(errors, "TEST(isolated_segv) killed by SIGSEGV") != NULL);
+    assert(strstr(errors, "TEST(isolated_abort) killed by SIGABRT") != NULL);
+}
+
+static void stuck_test(UTestRunner* utest __attribute__((unused)))
+{
+    printf("waiting forever");
+    fflush(stdout);
+    for (;;)
+        pause();
+}
+
+TEST(forked_timeout)
+{
+    UTestCase cases[2] = {
+        { .test = stuck_test,   .name = "stuck", .timeout_ms = 50 },
+        { .test = forked_print, .name = "not_stuck", .timeout_ms = 50 },
+    };
+    UTestCase* schedule[] = {&cases[0], &cases[1]};
+    int failed = 0;
+
+    CATCH_STDERR(errors) {
+        CATCH_OUTPUT(output) {
+            failed = RunForked(schedule, 2, 1);
+        }
+        eq(output, "waiting foreverxfrom a worker.");
+    }
+    eq(failed, 1);
+    eq(cases[0].status, 1);
+    eq(cases[1].status, 0);
+    assert(strstr(errors, "TEST(stuck) timed out after 50ms") != NULL);
+}
+
+static void stuck_capturing(UTestRunner* utest __attribute__((unused)))
+{
+    CATCH_OUTPUT(output) {
+        printf("half way there");
+        stuck_test(utest);
+    }
+}
+
+TEST(watchdog_timeout)
+{
+    UTestCase stuck = { .test = stuck_capturing, .name = "stuck_capturing", .timeout_ms = 50 };
+    UTestCase* schedule[] = {&stuck};
+    char report[512] = {0};
+    int fds[2], status = 0;
+    size_t len = 0;
+    ssize_t got;
+    pid_t pid;
+
+    assert(pipe(fds) == 0);
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDERR_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        RunSerial(schedule, 1);
+        _exit(0);
+    }
+    close(fds[1]);
+    while ((got = read(fds[0], report + len, sizeof(report) - len - 1)) > 0)
+        len += got;
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+
+    assert(WIFEXITED(status));
+    eq(WEXITSTATUS(status), 1);
+    assert(strstr(report, "TEST(stuck_capturing) ran for more than 50ms") != NULL);
+    assert(strstr(report, "half way there") != NULL);
+}
+
+static void threaded_check(UTestRunner* utest)
+{
+    if (_current_test != utest->test)
+        utest->test->status += 1;
+}
+
+static void threaded_fail(UTestRunner* utest __attribute__((unused)))
+{
+    _current_test->status += 1;
+}
+
+TEST(threaded_runner)
+{
+    UTestCase cases[64];
+    UTestCase* schedule[64];
+    int failed = 0;
+
+    memset(cases, 0, sizeof(cases));
+    for (int i = 0; i < 64; i++) {
+        cases[i].name = "threaded_case";
+        cases[i].test = i % 8 == 0 ? threaded_fail : threaded_check;
+        schedule[i] = &cases[i];
+    }
+
+    CATCH_OUTPUT(output) {
+        failed = RunThreaded(schedule, 64, 4);
+    }
+    eq(failed, 8);
+    eq(CURRENT_TEST_NAME, "threaded_runner");
+    for (int i = 0; i < 64; i++) {
+        eq(output[i], i % 8 == 0 ? 'x' : '.');
+        eq(cases[i].status, i % 8 == 0);
+    }
+}
+
+static void logged_fail(UTestRunner* utest)
+{
+    for (int i = 0; i < 100; i++)
+        utest->test->status += assertion_failure("%s %d\n", utest->test->name, i);
+}
+
+TEST(assertion_log)
+{
+    char names[16][16], message[1024];
+    UTestCase cases[16];
+    UTestCase* schedule[16];
+    const char* at;
+    int failed = 0;
+
+    memset(message, 'm', sizeof(message) - 1);
+    message[sizeof(message) - 1] = '\0';
+    CATCH_STDERR(errors) {
+        assertion_failure("%s|\n", message);
+    }
+    assert(strstr(errors, message) != NULL);
+    assert(strstr(errors, "m|\n") != NULL);
+
+    memset(cases, 0, sizeof(cases));
+    for (int i = 0; i < 16; i++) {
+        snprintf(names[i], sizeof(names[i]), "logged_%02d", i);
+        cases[i].name = names[i];
+        cases[i].test = logged_fail;
+        schedule[i] = &cases[i];
+    }
+    CATCH_STDERR(log) {
+        CATCH_OUTPUT(output) {
+            failed = RunThreaded(schedule, 16, 4);
+        }
+    }
+    eq(failed, 16);
+    at = log;
+    for (int i = 0; i < 32 && at != NULL; i++) {
+        snprintf(message, sizeof(message), "%s %d\n", names[i / 2], i % 2 ? 99 : 0);
+        at = strstr(at, message);
+    }
+    assert(at != NULL);
+}
+
+static void bench_loop(UTestRunner* utest)
+{
+    volatile size_t sink = 0;
+    utest->bench->bytes = 8;
+    for (size_t i = 0; i < utest->bench->n; i++)
+        sink += i;
+}
+
+TEST(bench_calibration)
+{
+    UTestCase bench = { .test = bench_loop, .name = "bench_loop", .bench = 1 };
+    double bench_time = Options.bench_time;
+    UTestRunner runner;
+    UTestBench b;
+    int failed = 0;
+
+    memset(&b, 0, sizeof(b));
+    RunnerInit(&runner);
+    runner.test = &bench;
+    runner.bench = &b;
+
+    Options.bench_time = 0.01;
+    CATCH_OUTPUT(output) {
+        failed = RunBench(&runner, NULL);
+    }
+    Options.bench_time = bench_time;
+
+    eq(failed, 0);
+    assert(b.n > 1);
+    assert(b.elapsed >= 0.01);
+    assert(strstr(output, "BENCH(bench_loop)") == output);
+    assert(strstr(output, "ns/op") != NULL);
+    assert(strstr(output, "MB/s") != NULL);
+    eq(RoundIterations(1), (size_t)1);
+    eq(RoundIterations(140), (size_t)200);
+    eq(RoundIterations(4000), (size_t)5000);
+    eq(RoundIterations(60000), (size_t)100000);
+}
+
+BENCH(bench_binary_compare)
+{
+    static byte_t left[4096], right[4096];
+    utest->bench->bytes = sizeof(left);
+    for (size_t i = 0; i < utest->bench->n; i++)
+        binary_compare(left, right, sizeof(left));
+}
+
+TEST(timer_resolution)
+{
+    ut_timer_t t;
+    ut_timer_start(&t);
+    usleep(2000);
+    ut_timer_end(&t);
+    assert(ut_timer_nsec(t) >= 2000000);
+    assert(ut_timer_usec(t) >= 2000.0);
+    assert(ut_timer_sec(t) < 1.0);
+
+    ut_timer_start(&t);
+    ut_timer_end(&t);
+    assert(ut_timer_nsec(t) < 1000000);
+
+    if (ut_timer_use_tsc(1)) {
+        ut_timer_start(&t);
+        usleep(2000);
+        ut_timer_end(&t);
+        assert(ut_timer_usec(t) >= 1900.0);
+        assert(ut_timer_sec(t) < 1.0);
+    }
+    eq(ut_timer_use_tsc(0), 0);
+}
+
+static void sleepy_test(UTestRunner* utest __attribute__((unused)))
+{
+    usleep(3000);
+}
+
+TEST(per_test_timing)
+{
+    UTestCase sleepy = { .test = sleepy_test, .name = "sleepy", .budget_ms = 1 };
+    UTestRunner runner;
+    int stderr_save = dup(STDERR_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    RunnerInit(&runner);
+    runner.test = &sleepy;
+
+    dup2(devnull, STDERR_FILENO);
+    _current_test = &sleepy;
+    ExecTest(&runner);
+    DrainLogs();
+    _current_test = utest->test;
+    dup2(stderr_save, STDERR_FILENO);
+    close(stderr_save);
+    close(devnull);
+
+    assert(sleepy.wall_ns >= 3000000);
+    assert(sleepy.cpu_ns < sleepy.wall_ns);
+    eq(sleepy.status, 1);
+
+    sleepy.status = 0;
+    Options.budget_warn = 1;
+    CATCH_OUTPUT(warning) {
+        _current_test = &sleepy;
+        ExecTest(&runner);
+        _current_test = utest->test;
+    }
+    Options.budget_warn = 0;
+    eq(sleepy.status, 0);
+    assert(strstr(warning, "over its 1ms budget") != NULL);
+}
+
+TEST(linker_section_registry)
+{
+    UTestCase** saved_all = AllTests;
+    UTestCase** saved_dyn = DynTests;
+    int saved_n = n_Tests, saved_n_dyn = n_DynTests, saved_cap_dyn = cap_DynTests;
+    UTestCase opt = { .ignore = 1 };
+
+    eq(AllTests[0]->name, "eq");
+    assert(AllTests[0]->test == TEST_NAME(eq));
+    assert(AllTests[0]->setup == setUp);
+    eq(AllTests[1]->ignore, 1);
+
+    /* register into a fresh table so the runner's state is left alone */
+    AllTests = NULL;
+    DynTests = NULL;
+    n_DynTests = cap_DynTests = 0;
+    utest_build_testcase(opt, forked_print, "runtime_test");
+    CollectTests();
+    eq(n_Tests, saved_n - saved_n_dyn + 1);
+    eq(AllTests[n_Tests - 1]->name, "runtime_test");
+    eq(AllTests[n_Tests - 1]->ignore, 1);
+
+    InternalFree(DynTests[0]);
+    InternalFree(DynTests);
+    InternalFree(AllTests);
+    AllTests = saved_all;
+    DynTests = saved_dyn;
+    n_Tests = saved_n;
+    n_DynTests = saved_n_dyn;
+    cap_DynTests = saved_cap_dyn;
+    assert_allocs_le(0);
+}
+
+TEST(test_filters)
+{
+    assert(MatchFilter("", "anything"));
+    assert(MatchFilter("arr_*", "arr_equals_int"));
+    assert(!MatchFilter("arr_*", "eq"));
+    assert(MatchFilter("eq:arr_*", "eq"));
+    assert(MatchFilter("eq,arr_*", "arr_contains_test"));
+    assert(!MatchFilter("arr_*:-arr_equals_*", "arr_equals_int"));
+    assert(MatchFilter("arr_*:-arr_equals_*", "arr_contains_test"));
+    assert(!MatchFilter("-*_test", "arr_contains_test"));
+    assert(MatchFilter("-*_test", "eq"));
+    assert(MatchFilter("?q", "eq"));
+
+    const char* filter = Options.filter;
+    Options.filter = "bench_binary_*,eq";
+    CATCH_OUTPUT(listing) {
+        ListTests();
+    }
+    Options.filter = filter;
+    eq(listing, "eq\n");
+}
+
+TEST(sharding)
+{
+    UTestCase cases[40];
+    UTestCase* shards[4][40];
+    int counts[4], seen[40] = {0};
+    char names[40][16];
+    char path[] = "/tmp/utest-durations-XXXXXX";
+    FILE* f;
+
+    memset(cases, 0, sizeof(cases));
+    for (int i = 0; i < 40; i++) {
+        snprintf(names[i], sizeof(names[i]), "shard_case_%d", i);
+        cases[i].name = names[i];
+    }
+
+    for (int s = 0; s < 4; s++) {
+        for (int i = 0; i < 40; i++)
+            shards[s][i] = &cases[i];
+        counts[s] = ShardTests(shards[s], 40, s, 4);
+        for (int i = 0; i < counts[s]; i++) {
+            seen[shards[s][i] - cases]++;
+            if (i > 0)
+                assert(shards[s][i - 1] < shards[s][i]);
+        }
+    }
+    eq(counts[0] + counts[1] + counts[2] + counts[3], 40);
+    for (int i = 0; i < 40; i++)
+        eq(seen[i], 1);
+
+    /* one slow test and a file listing it twice, the last entry wins */
+    close(mkstemp(path));
+    f = fopen(path, "w");
+    fprintf(f, "1 shard_case_0\n");
+    for (int i = 0; i < 40; i++)
+        fprintf(f, "%d %s\n", i == 0 ? 1000000 : 1000, names[i]);
+    fclose(f);
+
+    Options.shard_durations = path;
+    for (int s = 0; s < 4; s++) {
+        for (int i = 0; i < 40; i++)
+            shards[s][i] = &cases[i];
+        counts[s] = ShardTests(shards[s], 40, s, 4);
+        if (shards[s][0] == &cases[0])
+            eq(counts[s], 1);
+        else
+            eq(counts[s], 13);
+    }
+    Options.shard_durations = NULL;
+    unlink(path);
+}
+
+TEST(capture_fds)
+{
+    int fds[2];
+
+    CATCH_OUTPUT(out) {
+        CATCH_STDERR(err) {
+            printf("out 1,");
+            fprintf(stderr, "err 1,");
+            CATCH_OUTPUT(inner) {
+                printf("inner");
+                fprintf(stderr, "err 2");
+            }
+            eq(inner, "inner");
+            printf("out 2");
+        }
+        eq(err, "err 1,err 2");
+    }
+    eq(out, "out 1,out 2");
+
+    assert(pipe(fds) == 0);
+    CATCH_FD(fds[1], raw) {
+        assert(write(fds[1], "raw fd", 6) == 6);
+    }
+    eq(raw, "raw fd");
+    close(fds[0]);
+    close(fds[1]);
+
+    {
+        ut_capture_t a, b;
+        int res = 0;
+        eq(utest_capture_begin(&a, STDOUT_FILENO), 0);
+        eq(utest_capture_begin(&b, STDOUT_FILENO), 0);
+        CATCH_STDERR(order_err) {
+            res = utest_capture_end(&a);
+        }
+        eq(res, -1);
+        assert(strstr(order_err, "reverse order") != NULL);
+        eq(utest_capture_end(&b), 0);
+        eq(utest_capture_end(&a), 0);
+        eq(b.len, (size_t)1);
+        eq(a.len, (size_t)1);
+        utest_capture_free(a.buf);
+        utest_capture_free(b.buf);
+    }
+}
+
+TEST(vectorized_mismatch)
+{
+    size_t size = 1 << 16;
+    byte_t* left = malloc(size);
+    byte_t* right = malloc(size);
+    size_t offsets[] = {0, 1, 15, 16, 31, 32, 63, 64, 100, 1000, size - 33, size - 1};
+
+    for (size_t i = 0; i < size; i++)
+        left[i] = right[i] = (byte_t)(i * 7);
+
+    eq(binary_mismatch(left, right, size), size);
+    eq(binary_mismatch(left, right, 0), (size_t)0);
+    assert(binary_compare(left, right, size));
+    for (size_t k = 0; k < sizeof(offsets) / sizeof(offsets[0]); k++) {
+        right[offsets[k]] ^= 0x40;
+        eq(binary_mismatch(left, right, size), offsets[k]);
+        eq(binary_mismatch(left + 1, right + 1, size - 1), offsets[k] == 0 ? size - 1 : offsets[k] - 1);
+        eq(MismatchScalar(left, right, size), offsets[k]);
+        right[offsets[k]] ^= 0x40;
+    }
+
+    right[1000] = 'Z';
+    CATCH_STDERR(dump) {
+        utest_eqn_failure("file.c", 12, "left == right", left, right, size, 1000);
+    }
+    assert(strstr(dump, "file.c:12 'left == right' first difference at byte 1000 of 65536") != NULL);
+    assert(strstr(dump, "< 000003c0 ") != NULL);
+    assert(strstr(dump, "> 000003e0 ") != NULL);
+    assert(strstr(dump, "> 00000410 ") == NULL);
+    assert(strstr(dump, COL_ERROR " 5a" COL_RESET) != NULL);
+
+    free(left);
+    free(right);
+}
+
+TEST(unordered_equals)
+{
+    char* a[] = {"one", "two", "two", "three"};
+    char* b[] = {"two", "three", "one", "two"};
+    char* c[] = {"one", "one", "two", "three"};
+    int ints[] = {5, 1, 5, 3};
+    int same_ints[] = {3, 5, 1, 5};
+    int other_ints[] = {3, 1, 1, 5};
+
+    assert(arr_unordered_eq_s(a, b, 4));
+    assert(!arr_unordered_eq_s(a, c, 4));
+    assert(!arr_unordered_eq_s(c, a, 4));
+    assert(arr_unordered_eq_i(ints, same_ints, 4));
+    assert(!arr_unordered_eq_i(ints, other_ints, 4));
+    assert(arr_unordered_eq_n(ints, same_ints, 4, sizeof(int)));
+    assert(arr_eq_i(ints, ints, 4));
+    assert(!arr_eq_i(ints, same_ints, 4));
+    assert_unordered_eq(a, b, 4);
+    assert_unordered_eq(ints, same_ints, 4);
+
+    {
+        float zeros[] = {0.0f, 1.5f, -0.0f};
+        float signed_zeros[] = {-0.0f, 0.0f, 1.5f};
+        float nans[] = {NAN, 1.5f, 0.0f};
+        double dzeros[] = {-0.0, 2.0};
+        double dsigned[] = {2.0, 0.0};
+
+        assert(arr_eq_f(zeros, (float[]){-0.0f, 1.5f, 0.0f}, 3));
+        assert(arr_unordered_eq_f(zeros, signed_zeros, 3));
+        assert(arr_unordered_eq_d(dzeros, dsigned, 2));
+        assert(!arr_eq_f(nans, nans, 3));
+        assert(!arr_unordered_eq_f(nans, nans, 3));
+    }
+
+    {
+        size_t n = 100000;
+        char* chars = malloc(n * 8);
+        char** left = malloc(n * sizeof(char*));
+        char** right = malloc(n * sizeof(char*));
+        for (size_t i = 0; i < n; i++) {
+            snprintf(chars + i * 8, 8, "%zu", i);
+            left[i] = chars + i * 8;
+            right[n - 1 - i] = chars + i * 8;
+        }
+        assert(arr_unordered_eq_s(left, right, n));
+        right[0] = "nope";
+        assert(!arr_unordered_eq_s(left, right, n));
+        free(right);
+        free(left);
+        free(chars);
+    }
+
+    CATCH_STDERR(report) {
+        utest_unordered_failure("file.c", 3, "a", "c", a, c, 4, 0);
+    }
+    assert(strstr(report, "file.c:3 'a' and 'c' do not have the same elements") != NULL);
+    assert(strstr(report, "only in a: \"two\"\n") != NULL);
+    assert(strstr(report, "only in c: \"one\"\n") != NULL);
+
+    CATCH_STDERR(int_report) {
+        utest_unordered_failure("file.c", 4, "ints", "other", ints, other_ints, 4, sizeof(int));
+    }
+    {
+        /* the element bytes are printed in memory order */
+        char five[32] = "only in ints: 0x", one[32] = "only in other: 0x";
+        int v5 = 5, v1 = 1;
+        for (size_t i = 0; i < sizeof(int); i++) {
+            sprintf(five + strlen(five), "%02x", ((unsigned char*)&v5)[i]);
+            sprintf(one + strlen(one), "%02x", ((unsigned char*)&v1)[i]);
+        }
+        strcat(five, "\n");
+        strcat(one, "\n");
+        assert(strstr(int_report, five) != NULL);
+        assert(strstr(int_report, one) != NULL);
+    }
+}
+
+TEST(random_generators)
+{
+    ut_rand_t a, b;
+    int ints[1000];
+    char** strs;
+    byte_t bytes[13] = {0};
+
+    ut_rand_seed(&a, 42);
+    ut_rand_seed(&b, 42);
+    for (int i = 0; i < 100; i++)
+        eq(ut_rand_next(&a), ut_rand_next(&b));
+    eq(a.seed, (uint64_t)42);
+
+    for (int i = 0; i < 1000; i++)
+        assert(ut_rand_below(&a, 7) < 7);
+    eq(ut_rand_below(&a, 1), (uint64_t)0);
+
+    ut_rand_ints(&a, ints, 1000, -3, 3);
+    for (int i = 0; i < 1000; i++)
+        assert(ints[i] >= -3 && ints[i] <= 3);
+
+    {
+        UTestCase bad = { .name = "bad_range" };
+        ints[0] = 42;
+        CATCH_STDERR(errors) {
+            _current_test = &bad;
+            ut_rand_ints(&a, ints, 1, 3, -3);
+            _current_test = utest->test;
+        }
+        eq(bad.status, 1);
+        eq(ints[0], 42);
+        assert(strstr(errors, "ut_rand_ints called with min 3 greater than max -3") != NULL);
+    }
+
+    ut_rand_bytes(&a, bytes, sizeof(bytes));
+    assert(bytes[12] != 0 || bytes[11] != 0 || bytes[10] != 0);
+
+    strs = ut_rand_strings(&a, 100, 9);
+    for (int i = 0; i < 100; i++) {
+        eq(strlen(strs[i]), (size_t)9);
+        assert(strs[i] == (char*)strs + 100 * sizeof(char*) + i * 10);
+        for (int k = 0; k < 9; k++)
+            assert(strchr(character_set, strs[i][k]) != NULL);
+    }
+    free(strs);
+    /* sizes that overflow or can't be allocated give NULL */
+    assert(ut_rand_strings(&a, SIZE_MAX / 4, 8) == NULL);
+    assert(ut_rand_strings(&a, SIZE_MAX / 64, 8) == NULL);
+    assert(utest_random_strings(SIZE_MAX / 4, 8) == NULL);
+
+    /* the test's generator only depends on the run seed and the test name */
+    ut_rand_seed(&b, RunSeed() ^ HashName(CURRENT_TEST_NAME));
+    eq(utest_rand(), utest_rand());
+    eq(ut_rand_next(utest_rand()), ut_rand_next(&b));
+
+    strs = random_strings(3, 4);
+    for (int i = 0; i < 3; i++) {
+        eq(strlen(strs[i]), (size_t)4);
+        free(strs[i]);
+    }
+    free(strs);
+}
+
+static void arena_user(UTestRunner* utest __attribute__((unused)))
+{
+    for (int i = 0; i < 1000; i++)
+        utest_alloc(1000);
+}
+
+TEST(test_arena)
+{
+    char* a = utest_alloc(3);
+    char* b = utest_alloc(5);
+    char* big = utest_alloc(1 << 20);
+    char** strs = utest_random_strings(10, 4);
+    int* zeros = utest_calloc(100, sizeof(int));
+
+    eq((uintptr_t)a % 16, (uintptr_t)0);
+    eq((uintptr_t)b % 16, (uintptr_t)0);
+    eq(b - a, (long)16);
+    memset(big, 'x', 1 << 20);
+    eq(utest_strdup("copy"), "copy");
+    for (int i = 0; i < 10; i++)
+        eq(strlen(strs[i]), (size_t)4);
+    for (int i = 0; i < 100; i++)
+        eq(zeros[i], 0);
+
+    {
+        UTestCase user = { .test = arena_user, .name = "arena_user" };
+        UTestRunner runner;
+        struct utest_arena_chunk* saved = Arena;
+
+        Arena = NULL;
+        RunnerInit(&runner);
+        runner.test = &user;
+        _current_test = &user;
+        ExecTest(&runner);
+        _current_test = utest->test;
+
+        assert(Arena != NULL);
+        eq(Arena->used, (size_t)0);
+        assert(Arena->next == NULL);
+        assert(Arena->size <= ARENA_KEEP_CHUNK);
+        ResetArena(0);
+        assert(Arena == NULL);
+        Arena = saved;
+    }
+}
+
+static void leaky_test(UTestRunner* utest __attribute__((unused)))
+{
+    void* keep = malloc(100);
+    void* drop = calloc(10, 10);
+    drop = realloc(drop, 1000);
+    free(drop);
+    (void)keep;
+    utest_alloc(10);
+}
+
+TEST(allocation_tracking)
+{
+    UTestCase leaky = { .test = leaky_test, .name = "leaky" };
+    UTestRunner runner;
+    void* p;
+
+    eq(utest_alloc_tracking(), 1);
+    eq(utest_alloc_stats().allocs, (size_t)0);
+    p = malloc(64);
+    eq(utest_alloc_stats().allocs, (size_t)1);
+    eq(utest_alloc_stats().live, 64L);
+    assert_allocs_le(1);
+    free(p);
+    eq(utest_alloc_stats().frees, (size_t)1);
+    eq(utest_alloc_stats().live, 0L);
+    assert_live_bytes_le(0);
+
+    /* glibc frees the block and returns NULL for realloc(p, 0) */
+    p = realloc(malloc(32), 0);
+    if (p == NULL) {
+        eq(utest_alloc_stats().frees, (size_t)2);
+        eq(utest_alloc_stats().live, 0L);
+    }
+    free(p);
+
+    {
+        /* grows the size table and frees out of order */
+        enum { N = 1000 };
+        void* blocks[N];
+        for (int i = 0; i < N; i++)
+            blocks[i] = malloc(i + 1);
+        eq(utest_alloc_stats().live, (long)N * (N + 1) / 2);
+        for (int i = 0; i < N; i++)
+            free(blocks[(i * 7) % N]);
+        eq(utest_alloc_stats().live, 0L);
+    }
+
+    RunnerInit(&runner);
+    runner.test = &leaky;
+    _current_test = &leaky;
+    ExecTest(&runner);
+    _current_test = utest->test;
+    StartAllocTracking();
+
+    eq(leaky.alloc_stats.allocs, (size_t)3);
+    eq(leaky.alloc_stats.frees, (size_t)2);
+    /* requested sizes, not what the allocator rounded them up to */
+    eq(leaky.alloc_stats.bytes, (size_t)1200);
+    eq(leaky.alloc_stats.live, 100L);
+    eq(leaky.alloc_stats.peak, 1100L);
+
+    CATCH_OUTPUT(report) {
+        UTestCase* tests[] = {&leaky, utest->test};
+        PrintLeaks(tests, 2);
+    }
+    assert(strstr(report, "TEST(leaky) leaked") != NULL);
+    assert(strstr(report, "3 allocations and 2 frees") != NULL);
+}
+
+TEST(parse_options)
+{
+    struct utest_options saved = Options;
+    char* jobs[] = {"test", "-j3"};
+    char* junk[] = {"test", "-json"};
+    int status;
+
+    Options = (struct utest_options)DEFAULT_OPTIONS;
+    eq(ParseOptions(2, jobs), 0);
+    eq(Options.jobs, 3);
+    CATCH_STDERR(errors) {
+        status = ParseOptions(2, junk);
+    }
+    eq(status, -1);
+    assert(strstr(errors, "unknown option '-json'") != NULL);
+    Options = saved;
+}
+
+TEST(reporters)
+{
+    UTestCase passed = { .name = "passed", .wall_ns = 1500000 };
+    UTestCase failed = { .name = "fail<&>", .status = 1 };
+    UTestCase skipped = { .name = "skipped", .ignore = 1 };
+    char* xml = NULL;
+    char* json = NULL;
+    size_t xml_len, json_len;
+    FILE* xml_file = open_memstream(&xml, &xml_len);
+    FILE* json_file = open_memstream(&json, &json_len);
+    int depth = TestDepth;
+    const char* err = "\x1b[1;31mAssertion Failure:\x1b[0m \"a\" < 'b'\n";
+    /* keep the reports of this run out of it */
+    UTestReporter* saved[MAX_REPORTERS];
+    int n_saved = n_Reporters;
+    const char* suite = SuiteName;
+
+    memcpy(saved, Reporters, sizeof(saved));
+    n_Reporters = 0;
+    SuiteName = "utest";
+    utest_add_reporter(utest_junit_reporter(xml_file));
+    utest_add_reporter(utest_json_reporter(json_file));
+    TestDepth = 0;
+    ReportBegin(3);
+    ReportTest(&passed, "hello", 5, NULL, 0);
+    ReportTest(&failed, NULL, 0, err, strlen(err));
+    ReportTest(&skipped, NULL, 0, NULL, 0);
+    ReportEnd(3, 1);
+    TestDepth = depth;
+    InternalFree(Reporters[0]);
+    InternalFree(Reporters[1]);
+    memcpy(Reporters, saved, sizeof(saved));
+    n_Reporters = n_saved;
+    SuiteName = suite;
+    fclose(xml_file);
+    fclose(json_file);
+
+    assert(strstr(xml, "<testcase classname=\"utest\" name=\"passed\" time=\"0.001500\">\n"
+                       "    <system-out>hello</system-out>") != NULL);
+    assert(strstr(xml, "name=\"fail&lt;&amp;&gt;\"") != NULL);
+    assert(strstr(xml, "<failure message=\"1 failed assertions\">"
+                       "Assertion Failure: \"a\" &lt; 'b'\n</failure>") != NULL);
+    assert(strstr(xml, "<system-err>") == NULL);
+    assert(strstr(xml, "<skipped/>") != NULL);
+    assert(strstr(xml, "</testsuite>\n") != NULL);
+
+    assert(strstr(json, "{\"event\":\"start\",\"suite\":\"utest\",\"tests\":3,") == json);
+    assert(strstr(json, "\"name\":\"passed\",\"status\":\"passed\",\"failures\":0,"
+                        "\"wall_ns\":1500000,\"cpu_ns\":0,\"stdout\":\"hello\"") != NULL);
+    assert(strstr(json, "\"stderr\":\"Assertion Failure: \\\"a\\\" < 'b'\\n\"}\n") != NULL);
+    assert(strstr(json, "\"name\":\"skipped\",\"status\":\"skipped\"") != NULL);
+    assert(strstr(json, "{\"event\":\"end\",\"tests\":3,\"failed\":1}\n") != NULL);
+    free(xml);
+    free(json);
+}
+
+TEST(open_reports)
+{
+    char xml[] = "/tmp/utest_junit_XXXXXX";
+    char json[] = "/tmp/utest_json_XXXXXX";
+    char spec[64];
+    char buf[256] = {0};
+    UTestReporter* saved[MAX_REPORTERS];
+    UTestReporter* opened[MAX_REPORTERS];
+    int n_saved = n_Reporters, n_opened = n_Opened;
+    int depth = TestDepth;
+    FILE* f;
+
+    /* leave the reports of this run alone */
+    memcpy(saved, Reporters, sizeof(saved));
+    memcpy(opened, Opened, sizeof(opened));
+    n_Reporters = 0;
+    n_Opened = 0;
+    close(mkstemp(xml));
+    close(mkstemp(json));
+    snprintf(spec, sizeof(spec), "junit:%s,json:%s", xml, json);
+    eq(OpenReports(spec, NULL), 0);
+    eq(n_Reporters, 2);
+    TestDepth = 0;
+    ReportBegin(0);
+    ReportEnd(0, 0);
+    TestDepth = depth;
+    CloseReports();
+    eq(n_Reporters, 0);
+    eq(n_Opened, 0);
+    memcpy(Reporters, saved, sizeof(saved));
+    memcpy(Opened, opened, sizeof(opened));
+    n_Reporters = n_saved;
+    n_Opened = n_opened;
+
+    f = fopen(xml, "r");
+    assert(f != NULL);
+    assert(fread(buf, 1, sizeof(buf) - 1, f) > 0);
+    fclose(f);
+    assert(strstr(buf, "</testsuite>\n") != NULL);
+    unlink(xml);
+    unlink(json);
+    assert_allocs_le(0);
+}
+
+TEST(results_cache)
+{
+    char path[] = "/tmp/utest_cache_XXXXXX";
+    int fd = mkstemp(path);
+    FILE* f = fdopen(fd, "w");
+    UTestCase cases[4] = {
+        { .name = "a" }, { .name = "b" }, { .name = "c" }, { .name = "d" },
+    };
+    UTestCase* tests[] = {&cases[0], &cases[1], &cases[2], &cases[3]};
+    struct utest_cached* c;
+    size_t count;
+
+    assert(strlen(BuildId()) > 0);
+    fprintf(f, "F %s 10 a\n", BuildId());
+    fprintf(f, "P %s 10 a\n", BuildId());
+    fprintf(f, "F %s 20 b\n", BuildId());
+    fprintf(f, "P 0123abcd 30 c\n");
+    fprintf(f, "F 0123abcd 40 gone\n");
+    fclose(f);
+
+    eq(OrderByCache(path, tests, 4, 0), 4);
+    eq(tests[0]->name, "b");
+    eq(tests[1]->name, "d");
+    eq(tests[2]->name, "c");
+    eq(tests[3]->name, "a");
+    eq(OrderByCache(path, tests, 4, 1), 1);
+    eq(tests[0]->name, "b");
+
+    cases[0].status = 1;
+    cases[0].wall_ns = 50;
+    SaveCache(path, tests, 4);
+    c = LoadCache(path, &count);
+    eq(count, (size_t)5);
+    eq(c[0].name, "a");
+    eq(c[0].status, 'F');
+    eq(c[0].ns, 50ull);
+    eq(c[1].status, 'P');
+    assert(strcmp(c[2].build, BuildId()) == 0);
+    eq(c[4].name, "gone");
+    eq(c[4].status, 'F');
+    FreeCache(c, count);
+    unlink(path);
+}
+
+TEST(bench_baseline)
+{
+    double low[8] = {10, 11, 12, 13, 14, 15, 16, 17};
+    double high[8] = {20, 21, 22, 23, 24, 25, 26, 27};
+    double same[8] = {10, 10, 10, 10, 10, 10, 10, 10};
+    double slower[8] = {150, 151, 152, 153, 154, 155, 156, 157};
+    double nearly[8] = {103, 103, 103, 103, 103, 103, 103, 103};
+    double base_samples[8] = {100, 100, 101, 99, 100, 100, 101, 99};
+    struct utest_baseline base = { "b", 100, 0.5, 8, base_samples };
+    char path[] = "/tmp/utest_baseline_XXXXXX";
+    FILE* f;
+    int regressed = 0;
+
+    eq(Median(low, 8), 13.5);
+    eq(Median(low, 7), 13.0);
+    eq(MedianDeviation(high, 8, 23.5), 2.0);
+    eq(MannWhitney(high, 8, low, 8), 1);
+    eq(MannWhitney(low, 8, high, 8), -1);
+    eq(MannWhitney(same, 8, same, 8), 0);
+    eq(MannWhitney(high, 2, low, 2), 0);
+
+    CATCH_OUTPUT(output) {
+        regressed = CompareBaseline(&base, slower, 8, 153.5);
+    }
+    eq(regressed, 1);
+    assert(strstr(output, "+53.50% regression") != NULL);
+    CATCH_OUTPUT(printed) {
+        regressed = CompareBaseline(&base, nearly, 8, 103);
+    }
+    eq(regressed, 0);
+    eq(printed, "\t+3.00%");
+
+    close(mkstemp(path));
+    f = fopen(path, "w");
+    SaveBaseline(f, "bench_a", low, 8, 13.5, 2);
+    SaveBaseline(f, "bench_b", high, 2, 20.5, 0.5);
+    fclose(f);
+    LoadBaselines(path);
+    unlink(path);
+    eq(n_Baselines, 2);
+    assert(FindBaseline("missing") == NULL);
+    eq(FindBaseline("bench_b")->count, 2);
+    eq(FindBaseline("bench_b")->samples[1], 21.0);
+    eq(FindBaseline("bench_a")->median, 13.5);
+    eq(FindBaseline("bench_a")->samples[7], 17.0);
+    FreeBaselines();
+}
+
+TEST(perf_counters)
+{
+    UTestBench bench;
+    volatile size_t sink = 0;
+    int opened = 0;
+
+    memset(&bench, 0, sizeof(bench));
+    CATCH_STDERR(warning) {
+        opened = OpenPerfCounters();
+    }
+    if (opened == 0) {
+        assert(strstr(warning, "no performance counters available") != NULL);
+        return;
+    }
+
+    ut_bench_reset_timer(&bench);
+    ut_bench_start_timer(&bench);
+    for (int i = 0; i < 100000; i++)
+        sink += i;
+    ut_bench_stop_timer(&bench);
+
+    for (int i = 0; i < N_PERF_EVENTS; i++)
+        assert(ReadPerfCounter(i) >= 0 || Perf.fd[i] == -1);
+    if (Perf.fd[1] != -1)
+        assert(ReadPerfCounter(1) >= 100000);
+
+    CATCH_OUTPUT(output) {
+        PrintPerfCounters(100000);
+    }
+    assert(strncmp(output, "    perf:", 9) == 0);
+    ClosePerfCounters();
+    eq(ReadPerfCounter(0), -1.0);
+}
+
+TEST(perf_context_switches)
+{
+    UTestBench bench;
+    int ctx = N_PERF_EVENTS - 1;
+
+    eq(PerfEvents[ctx].name, "context-switches");
+    memset(&bench, 0, sizeof(bench));
+    CATCH_STDERR(warning) {
+        OpenPerfCounters();
+    }
+    if (Perf.fd[ctx] == -1) {
+        ClosePerfCounters();
+        return;
+    }
+
+    ut_bench_reset_timer(&bench);
+    ut_bench_start_timer(&bench);
+    for (int i = 0; i < 5; i++)
+        usleep(1000);
+    ut_bench_stop_timer(&bench);
+
+    assert(ReadPerfCounter(ctx) >= 5);
+    ClosePerfCounters();
+}
+
+static int compare_ints(const void* a, const void* b)
+{
+    int l = *(const int*)a, r = *(const int*)b;
+    return l < r ? -1 : l > r;
+}
+
+PROPERTY(sort_orders_ints, .cases = 2000)
+{
+    size_t n;
+    int* a = ut_gen_ints(gen, &n, 64, -1000, 1000);
+    qsort(a, n, sizeof(int), compare_ints);
+    for (size_t i = 1; i < n; i++)
+        assert(a[i - 1] <= a[i]);
+}
+
+TEST(gen_int_bounds)
+{
+    UTestCase bad = { .name = "bad_range" };
+    ut_gen_t gen;
+    int negative = 0, positive = 0;
+
+    memset(&gen, 0, sizeof(gen));
+    gen.random = 1;
+    ut_rand_seed(&gen.rng, 7);
+    for (int i = 0; i < 100; i++) {
+        int64_t v = ut_gen_int(&gen, INT64_MIN, INT64_MAX);
+        negative += v < 0;
+        positive += v > 0;
+    }
+    assert(negative > 10 && positive > 10);
+    eq(ut_gen_int(&gen, INT64_MAX, INT64_MAX), INT64_MAX);
+    eq(ut_gen_int(&gen, INT64_MIN, INT64_MIN), INT64_MIN);
+    for (int i = 0; i < 100; i++) {
+        int64_t v = ut_gen_int(&gen, INT64_MIN, INT64_MIN + 1);
+        assert(v == INT64_MIN || v == INT64_MIN + 1);
+        v = ut_gen_int(&gen, -1, INT64_MAX);
+        assert(v >= -1);
+    }
+
+    /* replaying a full range choice gives back the same value */
+    gen.pos = 0;
+    gen.len = 1;
+    gen.choices[0] = UINT64_MAX;
+    eq(ut_gen_int(&gen, INT64_MIN, INT64_MAX), INT64_MAX);
+
+    CATCH_STDERR(errors) {
+        _current_test = &bad;
+        eq(ut_gen_int(&gen, 1, 0), 1);
+        _current_test = utest->test;
+    }
+    eq(bad.status, 1);
+    assert(strstr(errors, "ut_gen_int called with min 1 greater than max 0") != NULL);
+    InternalFree(gen.choices);
+}
+
+static void sum_is_small(UTestRunner* utest __attribute__((unused)), ut_gen_t* gen)
+{
+    size_t n;
+    int sum = 0;
+    int* a = ut_gen_ints(gen, &n, 10, 0, 1000);
+    for (size_t i = 0; i < n; i++)
+        sum += a[i];
+    assert(sum < 100);
+}
+
+static void sum_test(UTestRunner* utest __attribute__((unused))) {}
+
+TEST(shrink_moves_between_choices)
+{
+    /* {5, 95} and {0, 100} only shrink to {100} by moving a value onto a
+       later choice and deleting an element together with its count */
+    uint64_t starts[2][3] = { {2, 5, 95}, {2, 0, 100} };
+    UTestCase prop = { .test = sum_test, .name = "sum_is_small" };
+    struct utest_prop_run run;
+    UTestRunner runner;
+
+    memset(&run, 0, sizeof(run));
+    run.test = &prop;
+    run.prop = sum_is_small;
+    RunnerInit(&runner);
+    runner.test = &prop;
+    _current_test = &prop;
+    Quiet++;
+    for (int i = 0; i < 2; i++) {
+        uint64_t best[3];
+        size_t len = 3;
+        memcpy(best, starts[i], sizeof(best));
+        Shrink(&run, &runner, best, &len);
+        starts[i][0] = len;
+        starts[i][1] = best[0];
+        starts[i][2] = best[1];
+    }
+    Quiet--;
+    _current_test = utest->test;
+
+    for (int i = 0; i < 2; i++) {
+        eq(starts[i][0], (uint64_t)2);
+        eq(starts[i][1], (uint64_t)1);
+        eq(starts[i][2], (uint64_t)100);
+    }
+}
+
+TEST(property_shrinking)
+{
+    UTestCase prop = { .test = sum_test, .name = "sum_is_small", .cases = 500 };
+    UTestRunner runner;
+
+    RunnerInit(&runner);
+    runner.test = &prop;
+    _current_test = &prop;
+    CATCH_STDERR(errors) {
+        CATCH_OUTPUT(output) {
+            utest_property(&runner, sum_is_small);
+        }
+        _current_test = utest->test;
+        /* the values go to the log, stdout is left to the property */
+        eq(output, "");
+    }
+
+    eq(prop.status, 1);
+    assert(strstr(errors, "Property Failure:") != NULL);
+    assert(strstr(errors, "TEST(sum_is_small) failed on case") != NULL);
+    assert(strstr(errors, "TEST(sum_is_small) tests/test.c:") != NULL);
+    assert(strstr(errors, "'sum < 100'") != NULL);
+    assert(strstr(errors, "  gen ints: {100}\n") != NULL);
+}
@@ -2,35 +2,140 @@
 #include "utest.h"
 #undef _UTEST_IMPL
 #include <stdarg.h>
+#include <errno.h>
+#include <ctype.h>
+#include <float.h>
+#include <math.h>
 #include <unistd.h>
 #include <time.h>
-#include <sys/time.h>
+#include <poll.h>
+#include <signal.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/auxv.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include <elf.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#include <immintrin.h>
+#endif
 
 int n_Tests;
-UTestCase *_current_test;
+__thread UTestCase *_current_test;
 UTestCase **AllTests;
 
-__attribute__((constructor(101)))
-void __setup(void)
-{
-    AllTests = (UTestCase**)malloc(0);
-    n_Tests = 0;
-}
+static UTestCase** DynTests;
+static int n_DynTests, cap_DynTests;
+
+/* Runner options, set from the environment and then the command line */
+#define DEFAULT_OPTIONS { .bench_time = 1.0, .bench_threshold = 5.0, .durations = -1 }
+static struct utest_options {
+    int jobs;
+    int isolate;
+    int batch;
+    int threads;
+    int bench;
+    double bench_time;
+    int bench_count;
+    int perf;
+    int cases;
+    int prop_threads;
+    double bench_threshold;
+    const char* baseline;
+    const char* save_baseline;
+    int durations;
+    int budget_ms;
+    int budget_warn;
+    int timeout_ms;
+    const char* report;
+    const char* cache;
+    int failed_first;
+    int last_failed;
+    const char* filter;
+    int list;
+    int shard_index;
+    int total_shards;
+    const char* shard_durations;
+    const char* save_durations;
+    uint64_t seed;
+    int seed_set;
+} Options = DEFAULT_OPTIONS;
+
+/* Number of tests this thread is in the middle of, runs inside a test are nested */
+static __thread int TestDepth;
+
+/* Set while a property tries inputs, assertions count but print nothing */
+static __thread int Quiet;
+
+static void RunnerInit(UTestRunner*);
+static int RunTest(UTestRunner*);
+static void ExecTest(UTestRunner*);
+static int PrintResult(UTestCase*);
+static int RunSerial(UTestCase**, int);
+static int RunForked(UTestCase**, int, int);
+static int RunThreaded(UTestCase**, int, int);
+static int RunBenchmarks(UTestCase**, int);
+static int ParseOptions(int, char**);
+static int PrintIgnored(void);
+static int TestSelected(UTestCase*);
+static void ListTests(void);
+static int ShardTests(UTestCase**, int, int, int);
+static void SaveDurations(const char*, UTestCase**, int);
+static void PrintDurations(UTestCase**, int, int);
+static void CollectTests(void);
+static uint64_t MonotonicNs(void);
+static uint64_t ThreadCpuNs(void);
+static int TempFd(void);
+static size_t FileSize(int fd);
+static void ReleaseCaptures(void);
+static void ReportSeed(UTestCase*);
+static uint64_t RunSeed(void);
+static void ResetArena(int keep);
+static void* InternalMalloc(size_t);
+static void* InternalCalloc(size_t, size_t);
+static void* InternalRealloc(void*, size_t);
+static void InternalFree(void*);
+static void StartAllocTracking(void);
+static ut_alloc_stats_t StopAllocTracking(void);
+static void PrintLeaks(UTestCase**, int);
+static int TestTimeout(UTestCase*);
+static struct utest_watch* StartWatchdog(UTestCase**, int, int);
+static void StopWatchdog(struct utest_watch*);
+static void ArmWatch(UTestCase*);
+static void DisarmWatch(void);
+static void UseWatch(struct utest_watch*, int);
+static void LogV(int, const char*, const char*, va_list);
+static void LogPrintf(int, const char*, ...) __attribute__((format(printf, 2, 3)));
+static void DrainLog(int);
+static void DrainLogs(void);
+static void FreeLogs(void);
+static void CatchCrashes(void);
+static int Reporting(void);
+static int OpenReports(const char*, const char*);
+static void CloseReports(void);
+static void ReportBegin(int);
+static void ReportTest(UTestCase*, const char*, size_t, const char*, size_t);
+static void ReportEnd(int, int);
+static int OrderByCache(const char*, UTestCase**, int, int);
+static void SaveCache(const char*, UTestCase**, int);
 
 __attribute__((destructor))
 void __cleanup(void)
 {
-    for (int i = 0; i < n_Tests; i++) {
-        free(AllTests[i]);
+    for (int i = 0; i < n_DynTests; i++) {
+        InternalFree(DynTests[i]);
     }
-    free(AllTests);
+    InternalFree(DynTests);
+    InternalFree(AllTests);
 }
 
-static void RunnerInit(UTestRunner*);
-static int RunTest(UTestRunner*);
-static int PrintIgnored(void);
-static size_t pipe_read_util(int fd, char** buffer);
-
 #define COL_OK      "\x1b[1;32m"
 #define COL_WARNING "\x1b[1;35m"
 #define COL_ERROR   "\x1b[1;31m"
@@ -40,303 +145,4356 @@ static size_t pipe_read_util(int fd, char** buffer);
 
 int RunTests(void)
 {
-    int status = 0, ignored;
-    int n = n_Tests;
-    UTestRunner runner;
-    RunnerInit(&runner);
+    return RunTestsArgs(0, NULL);
+}
 
-    ignored = PrintIgnored();
+int RunTestsArgs(int argc, char** argv)
+{
+    int status = 0;
+    int n = 0, selected, skipped = 0;
+    UTestCase** schedule;
 
-    for (int i = 0; i < n; i++)
-    {
-        if (AllTests[i]->ignore) {
-            continue;
-        }
+    /* a second run starts from the defaults, not the last run's options */
+    Options = (struct utest_options)DEFAULT_OPTIONS;
+    if (ParseOptions(argc, argv) != 0)
+        return 2;
+    if (Options.report != NULL && OpenReports(Options.report, argc > 0 ? argv[0] : NULL) != 0) {
+        CloseReports();
+        return 2;
+    }
+
+    RunSeed();
+    CollectTests();
+    if (Options.list) {
+        ListTests();
+        CloseReports();
+        return 0;
+    }
+    PrintIgnored();
 
-        _current_test = AllTests[i];
+    schedule = InternalMalloc((n_Tests + 1) * sizeof(UTestCase*));
+    for (int i = 0; i < n_Tests; i++)
+        if (!AllTests[i]->ignore && TestSelected(AllTests[i]))
+            schedule[n++] = AllTests[i];
 
-        runner.test = _current_test;
-        status += RunTest(&runner);
+    selected = n;
+    if (Options.total_shards > 1)
+        n = ShardTests(schedule, n, Options.shard_index, Options.total_shards);
+    if ((Options.failed_first || Options.last_failed) && !Options.bench)
+        n = OrderByCache(Options.cache, schedule, n, Options.last_failed);
+
+    /* ignored tests are reported as skipped and count towards the total */
+    for (int i = 0; i < n_Tests; i++)
+        if (AllTests[i]->ignore && TestSelected(AllTests[i]))
+            skipped++;
+    if (!Options.bench) {
+        ReportBegin(n + skipped);
+        for (int i = 0; i < n_Tests; i++)
+            if (AllTests[i]->ignore && TestSelected(AllTests[i]))
+                ReportTest(AllTests[i], NULL, 0, NULL, 0);
     }
-    _current_test = NULL;
 
-    n -= ignored;
+    if (Options.bench)
+        status = RunBenchmarks(schedule, n);
+    else if ((Options.jobs > 1 && n > 1) || Options.isolate)
+        status = RunForked(schedule, n, Options.jobs > 1 ? Options.jobs : 1);
+    else if (Options.threads > 1 && n > 1)
+        status = RunThreaded(schedule, n, Options.threads);
+    else
+        status = RunSerial(schedule, n);
+
+    if (Options.durations >= 0 && !Options.bench)
+        PrintDurations(schedule, n, Options.durations);
+    if (Options.save_durations != NULL && !Options.bench)
+        SaveDurations(Options.save_durations, schedule, n);
+    if (utest_alloc_tracking() && !Options.bench)
+        PrintLeaks(schedule, n);
+    if (Options.cache != NULL && !Options.bench)
+        SaveCache(Options.cache, schedule, n);
+    InternalFree(schedule);
+    if (!Options.bench)
+        ReportEnd(n + skipped, status);
+    CloseReports();
+
     if (status == 0)
         printf("\n" MSG_OK);
     else
         printf("\n" MSG_FAIL);
 
-    printf(": %d of %d tests passed\n", n - status, n);
+    printf(": %d of %d tests passed", n - status, n);
+    if (Options.total_shards > 1)
+        printf(" (shard %d of %d, %d tests in all shards)",
+               Options.shard_index, Options.total_shards, selected);
+    printf("\n");
 
     return status;
 }
 
+static int RunSerial(UTestCase** tests, int n)
+{
+    int failed = 0;
+    UTestRunner runner;
+    struct utest_watch* watches = StartWatchdog(tests, n, 1);
+    RunnerInit(&runner);
+
+    for (int i = 0; i < n; i++)
+    {
+        _current_test = tests[i];
+        runner.test = _current_test;
+        failed += RunTest(&runner);
+    }
+    _current_test = NULL;
+    StopWatchdog(watches);
+    return failed;
+}
+
 static int RunTest(UTestRunner* r) {
+    ut_capture_t out, err;
+    int failed;
+
     if (r->test->ignore)
         return 0;
+    if (!Reporting()) {
+        ExecTest(r);
+        DrainLogs();
+        return PrintResult(r->test);
+    }
 
-    if (r->test->setup != NULL)
-        r->test->setup();
+    /* reporters get the output of each test, it still goes to the terminal */
+    memset(&out, 0, sizeof(out));
+    memset(&err, 0, sizeof(err));
+    utest_capture_begin(&out, STDOUT_FILENO);
+    utest_capture_begin(&err, STDERR_FILENO);
+    ExecTest(r);
+    DrainLogs();
+    utest_capture_end(&err);
+    utest_capture_end(&out);
 
-    r->test->test(r);
+    if (out.len > 0 && fwrite(out.buf, 1, out.len - 1, stdout) != out.len - 1)
+        fprintf(stderr, "couldn't copy the output of TEST(%s)\n", r->test->name);
+    if (err.len > 0)
+        fwrite(err.buf, 1, err.len - 1, stderr);
+    failed = PrintResult(r->test);
+    ReportTest(r->test, out.buf, out.len > 0 ? out.len - 1 : 0,
+               err.buf, err.len > 0 ? err.len - 1 : 0);
+    utest_capture_free(out.buf);
+    utest_capture_free(err.buf);
+    return failed;
+}
 
-    if (r->test->teardown != NULL)
-        r->test->teardown();
+/**
+ * Run a test along with its setup and teardown without reporting anything.
+ */
+static void ExecTest(UTestRunner* r)
+{
+    UTestCase* test = r->test;
+    uint64_t wall = MonotonicNs(), cpu = ThreadCpuNs();
+    int budget_ms = test->budget_ms > 0 ? test->budget_ms : Options.budget_ms;
+
+    TestDepth++;
+    ArmWatch(test);
+    StartAllocTracking();
+    if (test->setup != NULL)
+        test->setup();
+
+    test->test(r);
 
-    if (r->test->capture_output)
-        free(r->test->output);
-    if (r->test->status == 0)
+    if (test->teardown != NULL)
+        test->teardown();
+    test->alloc_stats = StopAllocTracking();
+    DisarmWatch();
+
+    test->wall_ns = MonotonicNs() - wall;
+    test->cpu_ns = ThreadCpuNs() - cpu;
+
+    ReportSeed(test);
+    ReleaseCaptures();
+    ResetArena(1);
+    test->output = NULL;
+    TestDepth--;
+
+    if (budget_ms > 0 && test->wall_ns > (uint64_t)budget_ms * 1000000) {
+        if (Options.budget_warn)
+            utest_warning("TEST(%s) took %.3fms, over its %dms budget\n",
+                          test->name, test->wall_ns / 1e6, budget_ms);
+        else
+            test->status += assertion_failure("TEST(%s) took %.3fms, over its %dms budget\n",
+                                              test->name, test->wall_ns / 1e6, budget_ms);
+    }
+}
+
+static int PrintResult(UTestCase* test)
+{
+    if (test->status == 0)
         printf(".");
     else
         printf("x");
-    if (r->test->status > 0)
+    if (test->status > 0)
         return 1;
     return 0;
 }
 
-static int RunnerFail(const char* fmt, ...)
+/*
+ * Benchmarks
+ *
+ * A benchmark body is run with an increasing iteration count until a single
+ * run takes at least the target duration, then the last run is reported.
+ * Setup and teardown run around every round and are not timed. With
+ * --count N the calibrated round is repeated N times and the median and
+ * median absolute deviation of the samples are reported instead.
+ *
+ * Results can be saved as a baseline and later runs compared against it.
+ * A benchmark regresses when a Mann-Whitney U test says its samples are
+ * slower than the baseline's at the 5% level and its median went up by more
+ * than the threshold. The test uses the normal approximation with a tie
+ * correction and compares z squared against the critical value, so it
+ * takes no square root or normal distribution function. It can't reach
+ * significance with fewer than 4 samples on either side.
+ */
+
+struct utest_baseline {
+    char* name;
+    double median;
+    double mad;
+    int count;
+    double* samples;
+};
+
+static struct utest_baseline* Baselines;
+static int n_Baselines;
+
+static int CompareDoubles(const void* a, const void* b)
 {
-    char fmtbuf[256];
-    va_list args;
-    snprintf(fmtbuf, sizeof(fmtbuf), COL_ERROR "Assertion Failure:" COL_RESET " %s", fmt);
+    double l = *(const double*)a, r = *(const double*)b;
+    return l < r ? -1 : l > r;
+}
 
-    va_start(args, fmt);
-    vfprintf(stderr, fmtbuf, args);
-    va_end(args);
-    abort();
+/* Median of `n` sorted values */
+static double Median(const double* x, int n)
+{
+    if (n == 0)
+        return 0;
+    return n % 2 ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2;
 }
 
-static void RunnerInit(UTestRunner* runner)
+/* Median absolute deviation of `n` values around their median `m` */
+static double MedianDeviation(const double* x, int n, double m)
 {
-    runner->fail = RunnerFail;
-    runner->warning = utest_warning;
+    double* d = InternalMalloc((n + 1) * sizeof(double));
+    double mad;
+    for (int i = 0; i < n; i++)
+        d[i] = x[i] > m ? x[i] - m : m - x[i];
+    qsort(d, n, sizeof(double), CompareDoubles);
+    mad = Median(d, n);
+    InternalFree(d);
+    return mad;
 }
 
-void utest_build_testcase(UTestCase opt, TestMethod tst, char *name) {
-    UTestCase* newtest = malloc(sizeof(UTestCase));
-    newtest->name = name;
-    newtest->test = tst;
-    newtest->status = 0;
-    newtest->ignore = opt.ignore;
-    newtest->capture_output = opt.capture_output;
-    newtest->output = NULL;
+struct utest_ranked {
+    double value;
+    int first;
+};
 
-    if (opt.setup != NULL)
-        newtest->setup = opt.setup;
-    else
-        newtest->setup = NULL;
+static int CompareRanked(const void* a, const void* b)
+{
+    return CompareDoubles(&((const struct utest_ranked*)a)->value,
+                          &((const struct utest_ranked*)b)->value);
+}
 
-    if (opt.teardown != NULL)
-        newtest->teardown = opt.teardown;
-    else
-        newtest->teardown = NULL;
+/*
+ * Two sided Mann-Whitney U test at the 5% level. Returns 1 when the values
+ * in `a` are significantly larger than the ones in `b`, -1 when they are
+ * significantly smaller and 0 otherwise.
+ */
+static int MannWhitney(const double* a, int na, const double* b, int nb)
+{
+    int total = na + nb;
+    struct utest_ranked* v = InternalMalloc((total + 1) * sizeof(struct utest_ranked));
+    double rank_a = 0, ties = 0, u, mean, var, dev;
+
+    for (int i = 0; i < na; i++)
+        v[i] = (struct utest_ranked){ a[i], 1 };
+    for (int i = 0; i < nb; i++)
+        v[na + i] = (struct utest_ranked){ b[i], 0 };
+    qsort(v, total, sizeof(struct utest_ranked), CompareRanked);
+
+    for (int i = 0; i < total;)
+    {
+        int j = i;
+        while (j < total && v[j].value == v[i].value)
+            j++;
+        /* ranks i+1 .. j share their average */
+        for (int k = i; k < j; k++)
+            if (v[k].first)
+                rank_a += (i + 1 + j) / 2.0;
+        ties += (double)(j - i) * (j - i) * (j - i) - (j - i);
+        i = j;
+    }
+    InternalFree(v);
 
-    AllTests = (UTestCase**)realloc(
-        AllTests, (n_Tests + 1) * sizeof(UTestCase*));
-    AllTests[n_Tests++] = newtest;
+    u = rank_a - na * (na + 1) / 2.0;
+    mean = na * (double)nb / 2;
+    var = na * (double)nb / 12 * ((total + 1) - ties / ((double)total * (total - 1)));
+    dev = u - mean;
+    /* continuity correction */
+    dev = dev > 0.5 ? dev - 0.5 : dev < -0.5 ? dev + 0.5 : 0;
+    if (var <= 0 || dev * dev <= 1.959964 * 1.959964 * var)
+        return 0;
+    return dev > 0 ? 1 : -1;
 }
 
-static int PrintIgnored(void)
+/* Read "<name> <median> <mad> <count> <samples...>" lines, nanoseconds per op */
+static void LoadBaselines(const char* path)
 {
-    int i, n = 0;
-    for (i = 0; i < n_Tests; i++) {
-        if (AllTests[i]->ignore) {
-            printf(COL_WARNING "Ignoring testcase: " COL_RESET "'%s'\n", AllTests[i]->name);
-            n++;
-        }
+    FILE* f = fopen(path, "r");
+    char* line = NULL;
+    size_t cap = 0;
+    char name[1024];
+
+    if (f == NULL) {
+        fprintf(stderr, "couldn't read benchmark baseline '%s'\n", path);
+        return;
     }
-    return n;
+    while (getline(&line, &cap, f) > 0)
+    {
+        struct utest_baseline b;
+        int used;
+        char* p;
+
+        if (sscanf(line, "%1023s %lf %lf %d%n", name, &b.median, &b.mad, &b.count, &used) != 4
+            || b.count <= 0)
+            continue;
+        b.samples = InternalMalloc(b.count * sizeof(double));
+        p = line + used;
+        for (int i = 0; i < b.count; i++)
+            b.samples[i] = strtod(p, &p);
+        b.name = strdup(name);
+        Baselines = InternalRealloc(Baselines, (n_Baselines + 1) * sizeof(struct utest_baseline));
+        Baselines[n_Baselines++] = b;
+    }
+    InternalFree(line);
+    fclose(f);
 }
 
-int assertion_failure(const char* fmt, ...)
+static void FreeBaselines(void)
 {
-    char fmtbuf[256];
-    va_list args;
-    snprintf(fmtbuf, sizeof(fmtbuf), COL_ERROR "Assertion Failure:" COL_RESET " %s", fmt);
-    va_start(args, fmt);
-    vfprintf(stderr, fmtbuf, args);
-    va_end(args);
-    return 1;
+    for (int i = 0; i < n_Baselines; i++) {
+        InternalFree(Baselines[i].name);
+        InternalFree(Baselines[i].samples);
+    }
+    InternalFree(Baselines);
+    Baselines = NULL;
+    n_Baselines = 0;
 }
 
-int utest_warning(const char* fmt, ...)
+static struct utest_baseline* FindBaseline(const char* name)
 {
-    char fmtbuf[256];
-    va_list args;
-    snprintf(fmtbuf, sizeof(fmtbuf), COL_WARNING "Test Warning:" COL_RESET " %s", fmt);
-    va_start(args, fmt);
-    vfprintf(stdout, fmtbuf, args);
-    va_end(args);
-    return 1;
+    for (int i = 0; i < n_Baselines; i++)
+        if (strcmp(Baselines[i].name, name) == 0)
+            return &Baselines[i];
+    return NULL;
 }
 
-int utest_capture_output(char **buf, size_t* len)
+static void SaveBaseline(FILE* f, const char* name, const double* samples, int n,
+                         double median, double mad)
 {
-    static int init = 1;
-    static int stdout_save = -1;
-    static int outpipe[2] = {-1, -1};
+    fprintf(f, "%s %.3f %.3f %d", name, median, mad, n);
+    for (int i = 0; i < n; i++)
+        fprintf(f, " %.3f", samples[i]);
+    fprintf(f, "\n");
+    fflush(f);
+}
 
-    fflush(stdout);
-    if (init) // initialize output capture
-    {
-        if (pipe(outpipe) != 0) {
-            fprintf(stderr, "couldn't create output capture pipe\n");
-            exit(1);
-        }
-        if ((stdout_save = dup(STDOUT_FILENO)) == -1)
-            fprintf(stderr, "couldn't copy stdout\n");
-        if (dup2(outpipe[1], STDOUT_FILENO) == -1)
-            fprintf(stderr, "couldn't rediect stdout to pipe\n");
+/*
+ * Print how the samples compare to the baseline of the benchmark. Returns 1
+ * when the benchmark regressed.
+ */
+static int CompareBaseline(struct utest_baseline* b, const double* samples, int n, double median)
+{
+    double change = b->median > 0 ? (median - b->median) / b->median * 100 : 0;
+    int side = MannWhitney(samples, n, b->samples, b->count);
 
-        init = 0; // done with initialization
+    if (side > 0 && change > Options.bench_threshold) {
+        printf("\t" COL_ERROR "%+.2f%% regression" COL_RESET, change);
         return 1;
     }
-    else // end output capture
+    if (side != 0)
+        printf("\t%+.2f%%", change);
+    else
+        printf("\t~ (%+.2f%%, not significant)", change);
+    return 0;
+}
+
+/*
+ * Performance counters
+ *
+ * With --perf (or .perf = 1 on a benchmark) the benchmark opens one
+ * perf_event_open counter per event for the calling thread, and they run
+ * exactly while the benchmark timer does. The cpu events count user space
+ * only, context switches are counted where they happen, in the kernel. Events the
+ * kernel or the cpu refuses are left out (virtual machines often have no
+ * hardware counters, and perf_event_paranoid can forbid all of them). The
+ * counts are scaled by enabled / running time in case the kernel had to
+ * multiplex the counters.
+ */
+
+static const struct {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+} PerfEvents[] = {
+    { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "L1d-misses",    PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+                                           | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                                           | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { "LLC-misses",    PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL
+                                           | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                                           | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+#define N_PERF_EVENTS (int)(sizeof(PerfEvents) / sizeof(PerfEvents[0]))
+
+static struct {
+    int open;
+    int fd[N_PERF_EVENTS];
+} Perf;
+
+/* Open every counter the kernel allows, returns how many opened */
+static int OpenPerfCounters(void)
+{
+    static int warned;
+    int opened = 0, err = 0;
+
+    for (int i = 0; i < N_PERF_EVENTS; i++)
     {
-        write(outpipe[1], "", 1);
-        close(outpipe[1]);
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PerfEvents[i].type;
+        attr.config = PerfEvents[i].config;
+        attr.disabled = 1;
+        /* context switches happen in the kernel, only the cpu events are user space */
+        if (attr.type != PERF_TYPE_SOFTWARE) {
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+        }
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+#ifdef SYS_perf_event_open
+        Perf.fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+#else
+        Perf.fd[i] = -1;
+        errno = ENOSYS;
+#endif
+        if (Perf.fd[i] == -1)
+            err = errno;
+        else
+            opened++;
+    }
+    if (opened == 0 && !warned) {
+        warned = 1;
+        utest_warning("no performance counters available (%s), "
+                      "see /proc/sys/kernel/perf_event_paranoid\n", strerror(err));
+    }
+    Perf.open = opened > 0;
+    return opened;
+}
 
-        dup2(stdout_save, STDOUT_FILENO);
+static void ClosePerfCounters(void)
+{
+    for (int i = 0; i < N_PERF_EVENTS && Perf.open; i++)
+        if (Perf.fd[i] != -1)
+            close(Perf.fd[i]);
+    Perf.open = 0;
+}
 
-        *len = pipe_read_util(outpipe[0], buf);
-        _current_test->output = *buf;
-        close(outpipe[0]);
+static void PerfControl(unsigned long request)
+{
+    for (int i = 0; i < N_PERF_EVENTS && Perf.open; i++)
+        if (Perf.fd[i] != -1)
+            ioctl(Perf.fd[i], request, 0);
+}
 
-        init = 1; // should run init stage next time capture_output is run
-        outpipe[1] = -1; outpipe[0] = -1;
-        stdout_save = -1;
+/* The count of event `i` since the last reset, -1 if it isn't open */
+static double ReadPerfCounter(int i)
+{
+    uint64_t v[3];
+    if (!Perf.open || Perf.fd[i] == -1 || read(Perf.fd[i], v, sizeof(v)) != sizeof(v))
+        return -1;
+    if (v[2] == 0)
         return 0;
+    return (double)v[0] * v[1] / v[2];
+}
+
+/* Print every open counter per iteration of the last benchmark round */
+static void PrintPerfCounters(size_t n)
+{
+    double cycles = ReadPerfCounter(0), instructions = ReadPerfCounter(1);
+
+    if (!Perf.open)
+        return;
+    printf("    perf:");
+    for (int i = 0; i < N_PERF_EVENTS; i++)
+    {
+        double count = i == 0 ? cycles : i == 1 ? instructions : ReadPerfCounter(i);
+        if (count >= 0)
+            printf("  %.2f %s/op", count / n, PerfEvents[i].name);
     }
+    if (cycles > 0 && instructions >= 0)
+        printf("  %.2f IPC", instructions / cycles);
+    printf("\n");
 }
 
-static size_t pipe_read_util(int fd, char** buffer) {
-    char buf[256];
-    size_t buffer_len = 0;
-    size_t read_count = read(fd, buf, sizeof(buf)-1);
+void ut_bench_stop_timer(UTestBench* b)
+{
+    if (!b->running)
+        return;
+    PerfControl(PERF_EVENT_IOC_DISABLE);
+    ut_timer_end(&b->timer);
+    b->elapsed += ut_timer_sec(b->timer);
+    b->running = 0;
+}
 
-    if (read_count > 0) {
-        if (*buffer == NULL) {
-            *buffer = malloc(read_count + 1);
-        }
-        memcpy(*buffer, buf, read_count + 1);
+void ut_bench_start_timer(UTestBench* b)
+{
+    if (b->running)
+        return;
+    ut_timer_start(&b->timer);
+    b->running = 1;
+    PerfControl(PERF_EVENT_IOC_ENABLE);
+}
+
+void ut_bench_reset_timer(UTestBench* b)
+{
+    b->elapsed = 0;
+    PerfControl(PERF_EVENT_IOC_RESET);
+    if (b->running)
+        ut_timer_start(&b->timer);
+}
+
+static double BenchRound(UTestRunner* r, size_t n)
+{
+    UTestBench* b = r->bench;
+
+    b->n = n;
+    b->elapsed = 0;
+    b->running = 0;
+    PerfControl(PERF_EVENT_IOC_RESET);
+    if (r->test->setup != NULL)
+        r->test->setup();
+
+    StartAllocTracking();
+    ut_bench_start_timer(b);
+    r->test->test(r);
+    ut_bench_stop_timer(b);
+    r->test->alloc_stats = StopAllocTracking();
+
+    if (r->test->teardown != NULL)
+        r->test->teardown();
+    ReleaseCaptures();
+    ResetArena(1);
+    DrainLogs();
+    r->test->output = NULL;
+    return b->elapsed;
+}
+
+/* Round up to a 1, 2, 3 or 5 times a power of ten like `go test` does */
+static size_t RoundIterations(size_t n)
+{
+    size_t base = 1;
+    while (base * 10 <= n)
+        base *= 10;
+    if (n <= base)
+        return base;
+    if (n <= 2 * base)
+        return 2 * base;
+    if (n <= 3 * base)
+        return 3 * base;
+    if (n <= 5 * base)
+        return 5 * base;
+    return 10 * base;
+}
+
+static int RunBench(UTestRunner* r, FILE* save)
+{
+    size_t n = 1, max = 1000000000;
+    double elapsed;
+    int count = Options.bench_count > 0 ? Options.bench_count : 1;
+    double* samples = InternalMalloc(2 * count * sizeof(double));
+    double* sorted = samples + count;
+    double median, mad = 0;
+    struct utest_baseline* base;
+    int regressed = 0;
+
+    if (Options.perf || r->test->perf)
+        OpenPerfCounters();
+    elapsed = BenchRound(r, n);
+
+    while (elapsed < Options.bench_time && n < max && r->test->status == 0)
+    {
+        size_t next;
+        if (elapsed > 0)
+            next = (size_t)(1.2 * n * Options.bench_time / elapsed);
+        else
+            next = 100 * n;
+        if (next > 100 * n)
+            next = 100 * n;
+        next = RoundIterations(next);
+        if (next <= n)
+            next = n + 1;
+        n = next < max ? next : max;
+        elapsed = BenchRound(r, n);
     }
-    buffer_len = read_count;
 
-    while (read_count == sizeof(buf) - 1) {
-        read_count = read(fd, buf, sizeof(buf) - 1);
-        buffer_len += read_count;
+    samples[0] = elapsed * 1e9 / n;
+    for (int i = 1; i < count && r->test->status == 0; i++)
+        samples[i] = BenchRound(r, n) * 1e9 / n;
 
-        *buffer = realloc(*buffer, buffer_len + 1);
-        memcpy(*buffer + buffer_len - read_count, buf, read_count + 1);
+    if (r->test->status > 0) {
+        printf("BENCH(%s)\t" COL_ERROR "Fail" COL_RESET "\n", r->test->name);
+        ClosePerfCounters();
+        InternalFree(samples);
+        return 1;
     }
-    return buffer_len;
+
+    memcpy(sorted, samples, count * sizeof(double));
+    qsort(sorted, count, sizeof(double), CompareDoubles);
+    median = Median(sorted, count);
+    if (count > 1)
+        mad = MedianDeviation(samples, count, median);
+    elapsed = median * n / 1e9;
+
+    printf("BENCH(%s)\t%10zu\t%12.2f ns/op", r->test->name, n, median);
+    if (count > 1)
+        printf(" +/- %.2f", mad);
+    if (r->bench->bytes > 0)
+        printf("\t%10.2f MB/s", (double)r->bench->bytes * n / elapsed / 1e6);
+    if (utest_alloc_tracking())
+        printf("\t%8.2f allocs/op\t%10.2f B/op",
+               (double)r->test->alloc_stats.allocs / n,
+               (double)r->test->alloc_stats.bytes / n);
+    if ((base = FindBaseline(r->test->name)) != NULL)
+        regressed = CompareBaseline(base, samples, count, median);
+    printf("\n");
+    PrintPerfCounters(n);
+    ClosePerfCounters();
+
+    if (save != NULL)
+        SaveBaseline(save, r->test->name, samples, count, median, mad);
+    InternalFree(samples);
+    return regressed;
 }
 
-/**
- * Return: 1 for a match, 0 for not the same.
- */
-int binary_compare(byte_t* left, byte_t* right, size_t len) {
-    for (size_t i = 0; i < len; i++) {
-        if (left[i] != right[i]) {
-            return 0;
-        }
+static int RunBenchmarks(UTestCase** benches, int n)
+{
+    int failed = 0;
+    UTestRunner runner;
+    UTestBench bench;
+    FILE* save = NULL;
+    RunnerInit(&runner);
+
+    if (Options.baseline != NULL)
+        LoadBaselines(Options.baseline);
+    if (Options.save_baseline != NULL && (save = fopen(Options.save_baseline, "w")) == NULL)
+        fprintf(stderr, "couldn't write benchmark baseline '%s'\n", Options.save_baseline);
+
+    runner.bench = &bench;
+    for (int i = 0; i < n; i++)
+    {
+        memset(&bench, 0, sizeof(bench));
+        _current_test = benches[i];
+        runner.test = _current_test;
+        failed += RunBench(&runner, save);
     }
-    return 1;
+    _current_test = NULL;
+
+    if (save != NULL)
+        fclose(save);
+    FreeBaselines();
+    return failed;
 }
 
-#define _ARR_EQ_IMPL(SUFFIX, TYPE)                              \
-int arr_unordered_eq_##SUFFIX(TYPE *a1, TYPE *a2, size_t len) { \
-    for (size_t i = 0; i < len; i++) {                          \
-        for (size_t k = 0; k < len; k++) {                      \
-            if (a1[i] == a2[k]) {                               \
-                goto Found;                                     \
-            }                                                   \
-        }                                                       \
-        return 0;                                               \
-    Found:;                                                     \
-    }                                                           \
-    return 1;                                                   \
-}                                                               \
-int arr_eq_##SUFFIX(TYPE *arr1, TYPE *arr2, size_t len) {       \
-    for (size_t i = 0; i < len; i++)                            \
-        if (arr1[i] != arr2[i])                                 \
-            return 0;                                           \
-    return 1;                                                   \
-}
-#undef _ARR_EQ_IMPL // Not currently using this
+/*
+ * Assertion log
+ *
+ * Assertion failures, warnings and the details printed with them are
+ * formatted into a buffer owned by the thread that makes them instead of
+ * going to stdout and stderr one call at a time. There is one buffer per
+ * stream and nothing else ever touches it, so appending takes no lock and
+ * a message is never cut short. The runner drains the buffers after each
+ * test, in test order when tests run on several threads, and before a
+ * capture of stdout or stderr starts or ends, before a fork, and when a
+ * forked worker crashes. A buffer that grows past LOG_DRAIN_SIZE is
+ * drained early.
+ */
+
+#define LOG_DRAIN_SIZE (1 << 20)
 
-int arr_unordered_eq_s(char** a1, char** a2, size_t len)
+struct utest_log {
+    char* buf;
+    size_t len;
+    size_t cap;
+};
+
+/* index 0 holds what goes to stdout and 1 what goes to stderr */
+static __thread struct utest_log Logs[2];
+
+static void LogReserve(struct utest_log* log, size_t extra)
 {
-    size_t i, k;
-    for (i = 0; i < len; i++) {
-        for (k = 0; k < len; k++) {
-            if (strcmp(a1[i], a2[k]) == 0) {
-                goto Found;
-            }
-        }
-        return 0;
-    Found:;
-    }
-    return 1;
+    if (log->len + extra <= log->cap)
+        return;
+    while (log->len + extra > log->cap)
+        log->cap = log->cap ? log->cap * 2 : 4096;
+    log->buf = InternalRealloc(log->buf, log->cap);
 }
 
-int arr_eq_s(char** arr1, char** arr2, size_t len) {
-    for (size_t i = 0; i < len; i++)
-        if (strcmp(arr1[i], arr2[i]) != 0)
-            return 0;
-    return 1;
+static void RegisterLogFork(void)
+{
+    pthread_atfork(DrainLogs, NULL, NULL);
 }
 
-int strcomp(char* one, char* two) {
-    while (*one)
-        if (*one++ != *two++)
-            return 1;
-    return 0;
+static void LogV(int err, const char* prefix, const char* fmt, va_list args)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    struct utest_log* log = &Logs[err];
+    size_t plen = strlen(prefix);
+    va_list again;
+    int n;
+
+    pthread_once(&once, RegisterLogFork);
+    LogReserve(log, plen + 1);
+    memcpy(log->buf + log->len, prefix, plen);
+    log->len += plen;
+
+    /* format in place, and only when it doesn't fit grow and format again */
+    va_copy(again, args);
+    n = vsnprintf(log->buf + log->len, log->cap - log->len, fmt, args);
+    if (n >= 0 && (size_t)n >= log->cap - log->len) {
+        LogReserve(log, n + 1);
+        vsnprintf(log->buf + log->len, n + 1, fmt, again);
+    }
+    va_end(again);
+    if (n > 0)
+        log->len += n;
+    if (log->len > LOG_DRAIN_SIZE)
+        DrainLog(err);
 }
 
-int str_arr_contains(char** arr, size_t len, char* str)
+static void LogPrintf(int err, const char* fmt, ...)
 {
-    size_t i;
-    for (i = 0; i < len; i++)
-    {
-        if (strcmp(str, arr[i]) == 0) {
-            return 1;
-        }
-    }
-    return 0;
+    va_list args;
+    va_start(args, fmt);
+    LogV(err, "", fmt, args);
+    va_end(args);
 }
 
-static char character_set[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789,.-#'?!";
+/* Write out the stdout (0) or stderr (1) log of this thread */
+static void DrainLog(int err)
+{
+    struct utest_log* log = &Logs[err];
+    if (log->len == 0)
+        return;
+    fwrite(log->buf, 1, log->len, err ? stderr : stdout);
+    fflush(err ? stderr : stdout);
+    log->len = 0;
+}
 
-char** random_strings(int n_strings, int str_length)
+static void DrainLogs(void)
 {
-    srand(time(0));
+    DrainLog(0);
+    DrainLog(1);
+}
 
-    char** list = malloc(sizeof(char*) * n_strings);
-    int i, k;
-    for (i = 0; i < n_strings; i++)
-    {
-        list[i] = malloc((str_length + 1) * sizeof(char));
-        for (k = 0; k < str_length; k++)
-            list[i][k] = character_set[rand() % (sizeof(character_set) - 1)];
-        list[i][k] = '\0';
+static void FreeLogs(void)
+{
+    for (int i = 0; i < 2; i++) {
+        InternalFree(Logs[i].buf);
+        memset(&Logs[i], 0, sizeof(Logs[i]));
     }
-    return list;
 }
 
-void ut_timer_start(struct utest_timer* timer)
+/* Hand the logs of this thread over, leaving it with empty ones */
+static void TakeLogs(struct utest_log out[2])
 {
-    gettimeofday(&timer->start, NULL);
+    memcpy(out, Logs, sizeof(Logs));
+    memset(Logs, 0, sizeof(Logs));
 }
 
-void ut_timer_end(struct utest_timer* timer)
+static void WriteLogs(struct utest_log logs[2])
 {
-    gettimeofday(&timer->end, NULL);
+    for (int i = 0; i < 2; i++) {
+        if (logs[i].len > 0)
+            fwrite(logs[i].buf, 1, logs[i].len, i ? stderr : stdout);
+        InternalFree(logs[i].buf);
+    }
+    fflush(stderr);
 }
 
-double ut_timer_sec(struct utest_timer timer)
+/* A crashing worker writes out its logs with the only calls a signal handler can use */
+static void CrashHandler(int sig)
+{
+    if (Logs[0].len > 0 && write(STDOUT_FILENO, Logs[0].buf, Logs[0].len) < 0)
+        Logs[0].len = 0;
+    if (Logs[1].len > 0 && write(STDERR_FILENO, Logs[1].buf, Logs[1].len) < 0)
+        Logs[1].len = 0;
+    raise(sig);
+}
+
+static void CatchCrashes(void)
 {
-    long sec = (timer.end.tv_sec) - (timer.start.tv_sec);
-    long usec = (timer.end.tv_usec) - (timer.start.tv_usec);
-    return sec + (usec / 1e6);
-}
\ No newline at end of file
+    static const int signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = CrashHandler;
+    sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+        sigaction(signals[i], &sa, NULL);
+}
+
+/*
+ * Forked worker pool
+ *
+ * Each worker is a child process that pulls the next test index from a
+ * counter in shared memory, runs the test with stdout and stderr redirected
+ * into two temporary files, and then sends a result message followed by the
+ * contents of those files back to the runner over a pipe. The runner stores
+ * the results and prints them in the original test order as soon as every
+ * test before them has finished.
+ *
+ * Workers publish the index of the test they are running in shared memory,
+ * so when one dies the runner knows which test killed it. That test fails
+ * with the signal (or exit status) and whatever it printed, and a new
+ * worker takes over the rest of the queue. With --isolate=N a worker exits
+ * after N tests so a test can't leave broken state behind for many others.
+ * They also publish when that test started, and the runner kills a worker
+ * whose test runs past its timeout.
+ */
+
+struct utest_result_msg {
+    int index;
+    int status;
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+    ut_alloc_stats_t alloc_stats;
+    size_t out_len;
+    size_t err_len;
+};
+
+struct utest_result {
+    int done;
+    char* out;
+    size_t out_len;
+    char* err;
+    size_t err_len;
+};
+
+struct utest_worker {
+    pid_t pid;
+    long* running;
+    long* started;
+    int timed_out;
+    int res_fd;
+    int out_fd;
+    int err_fd;
+};
+
+/* An anonymous in-memory file, or an unlinked temporary file without memfd */
+static int TempFd(void)
+{
+    FILE* f;
+    int fd;
+#ifdef SYS_memfd_create
+    fd = syscall(SYS_memfd_create, "utest", 1 /* MFD_CLOEXEC */);
+    if (fd != -1)
+        return fd;
+#endif
+    f = tmpfile();
+    if (f == NULL)
+        return -1;
+    fd = dup(fileno(f));
+    fclose(f);
+    return fd;
+}
+
+static int WriteFull(int fd, const void* buf, size_t len)
+{
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Returns 1 when all of `len` was read, 0 on end of file and -1 on error */
+static int ReadFull(int fd, void* buf, size_t len)
+{
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static size_t FileSize(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return 0;
+    return st.st_size;
+}
+
+static void RewindFile(int fd)
+{
+    if (ftruncate(fd, 0) != 0)
+        return;
+    lseek(fd, 0, SEEK_SET);
+}
+
+/* Copy the first `len` bytes of file `src` into the pipe `dst` */
+static int CopyFile(int dst, int src, size_t len)
+{
+    char buf[4096];
+    off_t off = 0;
+    while ((size_t)off < len) {
+        size_t chunk = len - off < sizeof(buf) ? len - off : sizeof(buf);
+        ssize_t n = pread(src, buf, chunk, off);
+        if (n <= 0)
+            return -1;
+        if (WriteFull(dst, buf, n) != 0)
+            return -1;
+        off += n;
+    }
+    return 0;
+}
+
+static void WorkerLoop(UTestCase** tests, int n, long* next, struct utest_worker* w, int res_fd)
+{
+    UTestRunner runner;
+    struct utest_result_msg msg;
+    long i;
+    int ran = 0;
+
+    RunnerInit(&runner);
+    CatchCrashes();
+    dup2(w->out_fd, STDOUT_FILENO);
+    dup2(w->err_fd, STDERR_FILENO);
+
+    while ((Options.batch <= 0 || ran++ < Options.batch)
+           && (i = __atomic_fetch_add(next, 1, __ATOMIC_RELAXED)) < n)
+    {
+        RewindFile(w->out_fd);
+        RewindFile(w->err_fd);
+
+        __atomic_store_n(w->started, (long)MonotonicNs(), __ATOMIC_RELAXED);
+        __atomic_store_n(w->running, i, __ATOMIC_RELEASE);
+        _current_test = tests[i];
+        runner.test = _current_test;
+        ExecTest(&runner);
+        DrainLogs();
+        fflush(stdout);
+        fflush(stderr);
+
+        msg.index = i;
+        msg.status = tests[i]->status;
+        msg.wall_ns = tests[i]->wall_ns;
+        msg.cpu_ns = tests[i]->cpu_ns;
+        msg.alloc_stats = tests[i]->alloc_stats;
+        msg.out_len = FileSize(w->out_fd);
+        msg.err_len = FileSize(w->err_fd);
+        if (WriteFull(res_fd, &msg, sizeof(msg)) != 0
+            || CopyFile(res_fd, w->out_fd, msg.out_len) != 0
+            || CopyFile(res_fd, w->err_fd, msg.err_len) != 0)
+            break;
+        __atomic_store_n(w->running, -1, __ATOMIC_RELAXED);
+    }
+}
+
+static int SpawnWorker(struct utest_worker* w, UTestCase** tests, int n, long* next)
+{
+    int res[2];
+
+    w->out_fd = TempFd();
+    w->err_fd = TempFd();
+    if (w->out_fd == -1 || w->err_fd == -1 || pipe(res) != 0) {
+        fprintf(stderr, "couldn't create worker pipes\n");
+        return -1;
+    }
+
+    *w->running = -1;
+    w->timed_out = 0;
+    w->pid = fork();
+    if (w->pid == -1) {
+        fprintf(stderr, "couldn't fork test worker\n");
+        return -1;
+    }
+    if (w->pid == 0) {
+        close(res[0]);
+        WorkerLoop(tests, n, next, w, res[1]);
+        _exit(0);
+    }
+    close(res[1]);
+    w->res_fd = res[0];
+    return 0;
+}
+
+/*
+ * Read one result from a worker into `results`. Returns 0 once the worker
+ * has closed its end of the pipe.
+ */
+static int ReadResult(int fd, struct utest_result* results, UTestCase** tests, int n)
+{
+    struct utest_result_msg msg;
+    struct utest_result* r;
+
+    if (ReadFull(fd, &msg, sizeof(msg)) != 1)
+        return 0;
+    if (msg.index < 0 || msg.index >= n)
+        return 0;
+
+    r = &results[msg.index];
+    r->out = InternalMalloc(msg.out_len + 1);
+    r->err = InternalMalloc(msg.err_len + 1);
+    if (ReadFull(fd, r->out, msg.out_len) != 1
+        || ReadFull(fd, r->err, msg.err_len) != 1) {
+        InternalFree(r->out);
+        InternalFree(r->err);
+        r->out = r->err = NULL;
+        return 0;
+    }
+    r->out_len = msg.out_len;
+    r->err_len = msg.err_len;
+    r->done = 1;
+    tests[msg.index]->status = msg.status;
+    tests[msg.index]->wall_ns = msg.wall_ns;
+    tests[msg.index]->cpu_ns = msg.cpu_ns;
+    tests[msg.index]->alloc_stats = msg.alloc_stats;
+    return 1;
+}
+
+static const char* SignalName(int sig)
+{
+    switch (sig) {
+    case SIGABRT: return "SIGABRT";
+    case SIGALRM: return "SIGALRM";
+    case SIGBUS:  return "SIGBUS";
+    case SIGFPE:  return "SIGFPE";
+    case SIGILL:  return "SIGILL";
+    case SIGINT:  return "SIGINT";
+    case SIGKILL: return "SIGKILL";
+    case SIGPIPE: return "SIGPIPE";
+    case SIGSEGV: return "SIGSEGV";
+    case SIGTERM: return "SIGTERM";
+    case SIGTRAP: return "SIGTRAP";
+    default:      return "signal";
+    }
+}
+
+/* Read back what a test printed before its worker died */
+static char* ReadPartial(int fd, size_t* len, size_t extra)
+{
+    size_t size = FileSize(fd);
+    char* buf = InternalMalloc(size + extra + 1);
+    ssize_t n = pread(fd, buf, size, 0);
+    *len = n > 0 ? (size_t)n : 0;
+    return buf;
+}
+
+/*
+ * Wait for a worker that closed its pipe. If it died in the middle of a test
+ * that test is failed with the partial output it left behind.
+ */
+static void ReapWorker(struct utest_worker* w, struct utest_result* results, UTestCase** tests, int n)
+{
+    int status = 0;
+    long i = __atomic_load_n(w->running, __ATOMIC_ACQUIRE);
+    struct utest_result* r;
+    char why[128];
+
+    close(w->res_fd);
+    waitpid(w->pid, &status, 0);
+
+    if (i >= 0 && i < n && !results[i].done) {
+        if (w->timed_out)
+            snprintf(why, sizeof(why), "timed out after %dms", TestTimeout(tests[i]));
+        else if (WIFSIGNALED(status))
+            snprintf(why, sizeof(why), "killed by %s (%s)",
+                     SignalName(WTERMSIG(status)), strsignal(WTERMSIG(status)));
+        else
+            snprintf(why, sizeof(why), "exited with status %d", WEXITSTATUS(status));
+
+        r = &results[i];
+        r->out = ReadPartial(w->out_fd, &r->out_len, 0);
+        r->err = ReadPartial(w->err_fd, &r->err_len, sizeof(why) + strlen(tests[i]->name) + 32);
+        r->err_len += sprintf(r->err + r->err_len, COL_ERROR "Crash:" COL_RESET
+                              " TEST(%s) %s\n", tests[i]->name, why);
+        r->done = 1;
+        tests[i]->status = 1;
+    }
+    close(w->out_fd);
+    close(w->err_fd);
+}
+
+/*
+ * Kill the workers whose test ran past its timeout. Returns how many
+ * milliseconds the runner can wait before the next test could time out, or
+ * -1 when none of the tests has a timeout. A worker in between two tests is
+ * checked again after a short while.
+ */
+static int KillStuckWorkers(struct utest_worker* workers, struct pollfd* fds, int jobs,
+                            UTestCase** tests, int n, int timed)
+{
+    uint64_t now = MonotonicNs();
+    int wait = -1;
+
+    if (!timed)
+        return -1;
+
+    for (int w = 0; w < jobs; w++)
+    {
+        long i, left;
+        int timeout;
+
+        if (fds[w].fd == -1 || workers[w].timed_out)
+            continue;
+        i = __atomic_load_n(workers[w].running, __ATOMIC_ACQUIRE);
+        if (i < 0 || i >= n) {
+            wait = wait == -1 || wait > 10 ? 10 : wait;
+            continue;
+        }
+        if ((timeout = TestTimeout(tests[i])) <= 0)
+            continue;
+
+        left = timeout - (long)(now - __atomic_load_n(workers[w].started, __ATOMIC_RELAXED)) / 1000000;
+        if (left <= 0) {
+            workers[w].timed_out = 1;
+            kill(workers[w].pid, SIGKILL);
+        } else if (wait == -1 || left < wait) {
+            wait = left;
+        }
+    }
+    return wait;
+}
+
+static int RunForked(UTestCase** tests, int n, int jobs)
+{
+    struct utest_result* results;
+    struct utest_worker* workers;
+    struct pollfd* fds;
+    long* next;
+    int live = 0, printed = 0, failed = 0, timed = 0;
+
+    if (jobs > n)
+        jobs = n;
+    for (int i = 0; i < n && !timed; i++)
+        timed = TestTimeout(tests[i]) > 0;
+
+    next = mmap(NULL, (2 * jobs + 1) * sizeof(long), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (next == MAP_FAILED) {
+        fprintf(stderr, "couldn't map shared test counter\n");
+        return RunSerial(tests, n);
+    }
+    *next = 0;
+
+    results = InternalCalloc(n, sizeof(struct utest_result));
+    workers = InternalCalloc(jobs, sizeof(struct utest_worker));
+    fds = InternalCalloc(jobs, sizeof(struct pollfd));
+
+    fflush(stdout);
+    fflush(stderr);
+    for (int w = 0; w < jobs; w++)
+    {
+        fds[w].fd = -1;
+        workers[w].running = &next[2 * w + 1];
+        workers[w].started = &next[2 * w + 2];
+        if (SpawnWorker(&workers[w], tests, n, next) != 0)
+            continue;
+        fds[w].fd = workers[w].res_fd;
+        fds[w].events = POLLIN;
+        live++;
+    }
+
+    while (live > 0 || printed < n)
+    {
+        int wait = KillStuckWorkers(workers, fds, jobs, tests, n, timed);
+        if (live > 0 && poll(fds, jobs, wait) < 0 && errno != EINTR)
+            break;
+
+        for (int w = 0; w < jobs; w++)
+        {
+            if (fds[w].fd == -1 || fds[w].revents == 0)
+                continue;
+            if (!ReadResult(fds[w].fd, results, tests, n)) {
+                ReapWorker(&workers[w], results, tests, n);
+                fds[w].fd = -1;
+                live--;
+                if (__atomic_load_n(next, __ATOMIC_RELAXED) < n
+                    && SpawnWorker(&workers[w], tests, n, next) == 0) {
+                    fds[w].fd = workers[w].res_fd;
+                    live++;
+                }
+            }
+        }
+
+        for (; printed < n && (results[printed].done || live == 0); printed++)
+        {
+            struct utest_result* r = &results[printed];
+            if (!r->done) {
+                fprintf(stderr, COL_ERROR "Worker Failure:" COL_RESET
+                        " TEST(%s) did not report a result\n", tests[printed]->name);
+                tests[printed]->status += 1;
+            }
+            fwrite(r->out, 1, r->out_len, stdout);
+            fwrite(r->err, 1, r->err_len, stderr);
+            failed += PrintResult(tests[printed]);
+            ReportTest(tests[printed], r->out, r->out_len, r->err, r->err_len);
+            InternalFree(r->out);
+            InternalFree(r->err);
+        }
+        fflush(stdout);
+    }
+
+    munmap(next, (2 * jobs + 1) * sizeof(long));
+    InternalFree(fds);
+    InternalFree(workers);
+    InternalFree(results);
+    return failed;
+}
+
+/*
+ * Threaded runner
+ *
+ * Every thread owns a deque of test indices, stored as a [head, tail) range
+ * packed into one 64 bit word. The owner takes tests from the head and idle
+ * threads steal from the tail of the other deques, both with a single
+ * compare and swap. The current test is thread local so assertions made on
+ * a worker thread are counted against the test that thread is running.
+ */
+
+struct utest_deque {
+    uint64_t range;
+} __attribute__((aligned(64)));
+
+struct utest_thread {
+    pthread_t tid;
+    int id;
+    int failed;
+    struct utest_pool* pool;
+};
+
+struct utest_pool {
+    UTestCase** tests;
+    struct utest_log (*logs)[2];
+    struct utest_watch* watches;
+    int nthreads;
+    struct utest_deque* deques;
+};
+
+#define DEQUE_RANGE(HEAD, TAIL) (((uint64_t)(TAIL) << 32) | (uint32_t)(HEAD))
+
+static int DequeTake(struct utest_deque* d, int steal)
+{
+    uint64_t old = __atomic_load_n(&d->range, __ATOMIC_ACQUIRE);
+    uint64_t new;
+    uint32_t head, tail;
+    do {
+        head = (uint32_t)old;
+        tail = (uint32_t)(old >> 32);
+        if (head >= tail)
+            return -1;
+        if (steal)
+            new = DEQUE_RANGE(head, tail - 1);
+        else
+            new = DEQUE_RANGE(head + 1, tail);
+    } while (!__atomic_compare_exchange_n(&d->range, &old, new, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return steal ? (int)tail - 1 : (int)head;
+}
+
+static int NextTestIndex(struct utest_thread* t)
+{
+    struct utest_pool* pool = t->pool;
+    int i = DequeTake(&pool->deques[t->id], 0);
+
+    for (int k = 1; i == -1 && k < pool->nthreads; k++)
+        i = DequeTake(&pool->deques[(t->id + k) % pool->nthreads], 1);
+    return i;
+}
+
+static void* ThreadLoop(void* arg)
+{
+    struct utest_thread* t = arg;
+    UTestRunner runner;
+    int i;
+
+    RunnerInit(&runner);
+    UseWatch(t->pool->watches, t->id);
+    while ((i = NextTestIndex(t)) != -1)
+    {
+        _current_test = t->pool->tests[i];
+        runner.test = _current_test;
+        ExecTest(&runner);
+        TakeLogs(t->pool->logs[i]);
+        if (_current_test->status > 0)
+            t->failed++;
+    }
+    _current_test = NULL;
+    UseWatch(NULL, 0);
+    if (t->id > 0) {
+        ResetArena(0);
+        DrainLogs();
+        FreeLogs();
+    }
+    return NULL;
+}
+
+static int RunThreaded(UTestCase** tests, int n, int nthreads)
+{
+    struct utest_pool pool;
+    struct utest_thread* threads;
+    UTestCase* caller_test = _current_test;
+    int failed = 0;
+
+    if (nthreads > n)
+        nthreads = n;
+
+    pool.tests = tests;
+    pool.logs = InternalCalloc(n, sizeof(*pool.logs));
+    pool.watches = StartWatchdog(tests, n, nthreads);
+    pool.nthreads = nthreads;
+    pool.deques = aligned_alloc(64, nthreads * sizeof(struct utest_deque));
+    threads = InternalCalloc(nthreads, sizeof(struct utest_thread));
+
+    for (int t = 0; t < nthreads; t++)
+    {
+        int lo = (int)((long)n * t / nthreads);
+        int hi = (int)((long)n * (t + 1) / nthreads);
+        pool.deques[t].range = DEQUE_RANGE(lo, hi);
+        threads[t].id = t;
+        threads[t].pool = &pool;
+    }
+
+    fflush(stdout);
+    for (int t = 1; t < nthreads; t++)
+    {
+        if (pthread_create(&threads[t].tid, NULL, ThreadLoop, &threads[t]) != 0) {
+            fprintf(stderr, "couldn't create test thread\n");
+            threads[t].tid = 0;
+        }
+    }
+    /* the calling thread works too, any deque left by a failed thread gets stolen */
+    ThreadLoop(&threads[0]);
+    _current_test = caller_test;
+
+    for (int t = 0; t < nthreads; t++)
+    {
+        if (t > 0 && threads[t].tid != 0)
+            pthread_join(threads[t].tid, NULL);
+        failed += threads[t].failed;
+    }
+
+    for (int i = 0; i < n; i++) {
+        WriteLogs(pool.logs[i]);
+        PrintResult(tests[i]);
+        ReportTest(tests[i], NULL, 0, NULL, 0);
+    }
+    InternalFree(pool.logs);
+
+    StopWatchdog(pool.watches);
+    InternalFree(threads);
+    InternalFree(pool.deques);
+    return failed;
+}
+
+/* Parse a job count, where zero means one job per online cpu */
+static int ParseJobs(const char* s)
+{
+    int jobs = atoi(s);
+    if (jobs <= 0)
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    return jobs < 1 ? 1 : jobs;
+}
+
+static int ParseOptions(int argc, char** argv)
+{
+    char* env;
+
+    if ((env = getenv("UTEST_JOBS")) != NULL)
+        Options.jobs = ParseJobs(env);
+    if ((env = getenv("UTEST_ISOLATE")) != NULL)
+        Options.isolate = 1, Options.batch = atoi(env);
+    if ((env = getenv("UTEST_THREADS")) != NULL)
+        Options.threads = ParseJobs(env);
+    if ((env = getenv("UTEST_FILTER")) != NULL)
+        Options.filter = env;
+    if ((env = getenv("UTEST_SHARD_INDEX")) != NULL)
+        Options.shard_index = atoi(env);
+    if ((env = getenv("UTEST_TOTAL_SHARDS")) != NULL)
+        Options.total_shards = atoi(env);
+    if ((env = getenv("UTEST_SHARD_DURATIONS")) != NULL)
+        Options.shard_durations = env;
+    if ((env = getenv("UTEST_SAVE_DURATIONS")) != NULL)
+        Options.save_durations = env;
+    if ((env = getenv("UTEST_SEED")) != NULL)
+        Options.seed = strtoull(env, NULL, 0), Options.seed_set = 1;
+    if ((env = getenv("UTEST_BENCHTIME")) != NULL)
+        Options.bench_time = atof(env) / 1e3;
+    if ((env = getenv("UTEST_BENCH_COUNT")) != NULL)
+        Options.bench_count = atoi(env);
+    if ((env = getenv("UTEST_CASES")) != NULL)
+        Options.cases = atoi(env);
+    if ((env = getenv("UTEST_PROP_THREADS")) != NULL)
+        Options.prop_threads = atoi(env);
+    if ((env = getenv("UTEST_PERF")) != NULL)
+        Options.perf = atoi(env);
+    if ((env = getenv("UTEST_BENCH_THRESHOLD")) != NULL)
+        Options.bench_threshold = atof(env);
+    if ((env = getenv("UTEST_BASELINE")) != NULL)
+        Options.baseline = env;
+    if ((env = getenv("UTEST_SAVE_BASELINE")) != NULL)
+        Options.save_baseline = env;
+    if ((env = getenv("UTEST_DURATIONS")) != NULL)
+        Options.durations = atoi(env);
+    if ((env = getenv("UTEST_BUDGET_MS")) != NULL)
+        Options.budget_ms = atoi(env);
+    if ((env = getenv("UTEST_CACHE")) != NULL)
+        Options.cache = env;
+    if ((env = getenv("UTEST_REPORT")) != NULL)
+        Options.report = env;
+    if ((env = getenv("UTEST_TIMEOUT_MS")) != NULL)
+        Options.timeout_ms = atoi(env);
+    if ((env = getenv("UTEST_BUDGET_WARN")) != NULL)
+        Options.budget_warn = atoi(env);
+    if ((env = getenv("UTEST_TIMER")) != NULL)
+        ut_timer_use_tsc(strcmp(env, "tsc") == 0);
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0)
+            Options.jobs = ParseJobs(
+                i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]) ? argv[++i] : "0");
+        else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] != '\0'
+                 && strspn(argv[i] + 2, "0123456789") == strlen(argv[i] + 2))
+            Options.jobs = ParseJobs(argv[i] + 2);
+        else if (strcmp(argv[i], "--isolate") == 0)
+            Options.isolate = 1;
+        else if (strncmp(argv[i], "--isolate=", 10) == 0)
+            Options.isolate = 1, Options.batch = atoi(argv[i] + 10);
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+            Options.filter = argv[++i];
+        else if (strncmp(argv[i], "--filter=", 9) == 0)
+            Options.filter = argv[i] + 9;
+        else if (strncmp(argv[i], "--shard-index=", 14) == 0)
+            Options.shard_index = atoi(argv[i] + 14);
+        else if (strncmp(argv[i], "--total-shards=", 15) == 0)
+            Options.total_shards = atoi(argv[i] + 15);
+        else if (strncmp(argv[i], "--shard-durations=", 18) == 0)
+            Options.shard_durations = argv[i] + 18;
+        else if (strncmp(argv[i], "--save-durations=", 17) == 0)
+            Options.save_durations = argv[i] + 17;
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            Options.seed = strtoull(argv[++i], NULL, 0), Options.seed_set = 1;
+        else if (strncmp(argv[i], "--seed=", 7) == 0)
+            Options.seed = strtoull(argv[i] + 7, NULL, 0), Options.seed_set = 1;
+        else if (strcmp(argv[i], "--list") == 0)
+            Options.list = 1;
+        else if (strcmp(argv[i], "--bench") == 0)
+            Options.bench = 1;
+        else if (strcmp(argv[i], "--benchtime") == 0 && i + 1 < argc)
+            Options.bench_time = atof(argv[++i]) / 1e3;
+        else if (strncmp(argv[i], "--benchtime=", 12) == 0)
+            Options.bench_time = atof(argv[i] + 12) / 1e3;
+        else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc)
+            Options.bench_count = atoi(argv[++i]);
+        else if (strncmp(argv[i], "--count=", 8) == 0)
+            Options.bench_count = atoi(argv[i] + 8);
+        else if (strncmp(argv[i], "--cases=", 8) == 0)
+            Options.cases = atoi(argv[i] + 8);
+        else if (strncmp(argv[i], "--prop-threads=", 15) == 0)
+            Options.prop_threads = atoi(argv[i] + 15);
+        else if (strcmp(argv[i], "--perf") == 0)
+            Options.perf = 1;
+        else if (strncmp(argv[i], "--threshold=", 12) == 0)
+            Options.bench_threshold = atof(argv[i] + 12);
+        else if (strncmp(argv[i], "--baseline=", 11) == 0)
+            Options.baseline = argv[i] + 11;
+        else if (strncmp(argv[i], "--save-baseline=", 16) == 0)
+            Options.save_baseline = argv[i] + 16;
+        else if (strcmp(argv[i], "--durations") == 0 && i + 1 < argc)
+            Options.durations = atoi(argv[++i]);
+        else if (strncmp(argv[i], "--durations=", 12) == 0)
+            Options.durations = atoi(argv[i] + 12);
+        else if (strcmp(argv[i], "--budget-ms") == 0 && i + 1 < argc)
+            Options.budget_ms = atoi(argv[++i]);
+        else if (strncmp(argv[i], "--budget-ms=", 12) == 0)
+            Options.budget_ms = atoi(argv[i] + 12);
+        else if (strncmp(argv[i], "--cache=", 8) == 0)
+            Options.cache = argv[i] + 8;
+        else if (strcmp(argv[i], "--failed-first") == 0)
+            Options.failed_first = 1;
+        else if (strcmp(argv[i], "--last-failed") == 0)
+            Options.last_failed = 1;
+        else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc)
+            Options.report = argv[++i];
+        else if (strncmp(argv[i], "--report=", 9) == 0)
+            Options.report = argv[i] + 9;
+        else if (strcmp(argv[i], "--timeout-ms") == 0 && i + 1 < argc)
+            Options.timeout_ms = atoi(argv[++i]);
+        else if (strncmp(argv[i], "--timeout-ms=", 13) == 0)
+            Options.timeout_ms = atoi(argv[i] + 13);
+        else if (strcmp(argv[i], "--budget-warn") == 0)
+            Options.budget_warn = 1;
+        else if (strncmp(argv[i], "--timer=", 8) == 0)
+            ut_timer_use_tsc(strcmp(argv[i] + 8, "tsc") == 0);
+        else if (strcmp(argv[i], "--threads") == 0)
+            Options.threads = ParseJobs(
+                i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]) ? argv[++i] : "0");
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+            Options.threads = ParseJobs(argv[i] + 10);
+        else {
+            fprintf(stderr, "utest: unknown option '%s'\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (Options.total_shards > 1
+        && (Options.shard_index < 0 || Options.shard_index >= Options.total_shards)) {
+        fprintf(stderr, "utest: shard index %d is not in [0, %d)\n",
+                Options.shard_index, Options.total_shards);
+        return -1;
+    }
+    if ((Options.baseline != NULL || Options.save_baseline != NULL) && Options.bench_count <= 0)
+        Options.bench_count = 10;
+    if ((Options.failed_first || Options.last_failed) && Options.cache == NULL)
+        Options.cache = ".utest-cache";
+    return 0;
+}
+
+static int RunnerFail(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    LogV(1, COL_ERROR "Assertion Failure:" COL_RESET " ", fmt, args);
+    va_end(args);
+    DrainLogs();
+    abort();
+}
+
+static void RunnerInit(UTestRunner* runner)
+{
+    runner->fail = RunnerFail;
+    runner->warning = utest_warning;
+    runner->bench = NULL;
+}
+
+/*
+ * Reporters
+ *
+ * Results are streamed to every reporter as each test is printed, so a
+ * report is never held in memory and a crashed run still leaves a report of
+ * the tests that finished. The JUnit XML and newline delimited JSON
+ * reporters write one record per test, flushed right away. Terminal color
+ * codes are dropped from the captured output since they are not valid XML.
+ * Runs started from inside a test are not reported.
+ */
+
+#define MAX_REPORTERS 8
+
+static UTestReporter* Reporters[MAX_REPORTERS];
+static int n_Reporters;
+/* reporters made by OpenReports, closed and freed by CloseReports */
+static UTestReporter* Opened[MAX_REPORTERS];
+static int n_Opened;
+static const char* SuiteName = "utest";
+
+int utest_add_reporter(UTestReporter* rep)
+{
+    if (n_Reporters >= MAX_REPORTERS)
+        return -1;
+    Reporters[n_Reporters++] = rep;
+    return 0;
+}
+
+static int Reporting(void)
+{
+    return n_Reporters > 0 && TestDepth == 0;
+}
+
+static void ReportBegin(int n)
+{
+    if (!Reporting())
+        return;
+    for (int i = 0; i < n_Reporters; i++)
+        if (Reporters[i]->begin != NULL)
+            Reporters[i]->begin(Reporters[i], n);
+}
+
+static void ReportTest(UTestCase* test, const char* out, size_t out_len,
+                       const char* err, size_t err_len)
+{
+    if (!Reporting())
+        return;
+    for (int i = 0; i < n_Reporters; i++)
+        if (Reporters[i]->test != NULL)
+            Reporters[i]->test(Reporters[i], test, out, out_len, err, err_len);
+}
+
+static void ReportEnd(int n, int failed)
+{
+    if (!Reporting())
+        return;
+    for (int i = 0; i < n_Reporters; i++)
+        if (Reporters[i]->end != NULL)
+            Reporters[i]->end(Reporters[i], n, failed);
+}
+
+/* Length of the terminal escape sequence at the start of `s`, if there is one */
+static size_t EscapeSequence(const char* s, size_t len)
+{
+    size_t i = 2;
+    if (len < 2 || s[0] != '\x1b' || s[1] != '[')
+        return 0;
+    while (i < len && (isdigit((unsigned char)s[i]) || s[i] == ';'))
+        i++;
+    return i < len ? i + 1 : len;
+}
+
+static const char* TestStatus(UTestCase* test)
+{
+    if (test->ignore)
+        return "skipped";
+    return test->status > 0 ? "failed" : "passed";
+}
+
+/* Write `s` as character data, `quot` also escapes quotes for attributes */
+static void WriteXml(FILE* f, const char* s, size_t len, int quot)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = s[i];
+        size_t esc = EscapeSequence(s + i, len - i);
+        if (esc > 0)
+            i += esc - 1;
+        else if (c == '<')
+            fputs("&lt;", f);
+        else if (c == '>')
+            fputs("&gt;", f);
+        else if (c == '&')
+            fputs("&amp;", f);
+        else if (c == '"' && quot)
+            fputs("&quot;", f);
+        else if (c < 0x20 && c != '\n' && c != '\t' && c != '\r')
+            fputc('?', f);
+        else
+            fputc(c, f);
+    }
+}
+
+static void JUnitBegin(UTestReporter* rep, int n)
+{
+    fprintf(rep->file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuite name=\"");
+    WriteXml(rep->file, SuiteName, strlen(SuiteName), 1);
+    fprintf(rep->file, "\" tests=\"%d\">\n", n);
+    fflush(rep->file);
+}
+
+static void JUnitTest(UTestReporter* rep, UTestCase* test, const char* out, size_t out_len,
+                      const char* err, size_t err_len)
+{
+    FILE* f = rep->file;
+
+    fprintf(f, "  <testcase classname=\"");
+    WriteXml(f, SuiteName, strlen(SuiteName), 1);
+    fprintf(f, "\" name=\"");
+    WriteXml(f, test->name, strlen(test->name), 1);
+    fprintf(f, "\" time=\"%.6f\">\n", test->wall_ns / 1e9);
+
+    if (test->ignore) {
+        fprintf(f, "    <skipped/>\n");
+    } else if (test->status > 0) {
+        fprintf(f, "    <failure message=\"%d failed assertions\">", test->status);
+        WriteXml(f, err, err_len, 0);
+        fprintf(f, "</failure>\n");
+    }
+    if (out_len > 0) {
+        fprintf(f, "    <system-out>");
+        WriteXml(f, out, out_len, 0);
+        fprintf(f, "</system-out>\n");
+    }
+    /* a failure already holds the stderr of the test */
+    if (err_len > 0 && !(test->status > 0 && !test->ignore)) {
+        fprintf(f, "    <system-err>");
+        WriteXml(f, err, err_len, 0);
+        fprintf(f, "</system-err>\n");
+    }
+    fprintf(f, "  </testcase>\n");
+    fflush(f);
+}
+
+static void JUnitEnd(UTestReporter* rep, int n __attribute__((unused)), int failed __attribute__((unused)))
+{
+    fprintf(rep->file, "</testsuite>\n");
+    fflush(rep->file);
+}
+
+static void WriteJsonString(FILE* f, const char* s, size_t len)
+{
+    fputc('"', f);
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = s[i];
+        size_t esc = EscapeSequence(s + i, len - i);
+        if (esc > 0)
+            i += esc - 1;
+        else if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c == '\n')
+            fputs("\\n", f);
+        else if (c == '\t')
+            fputs("\\t", f);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void JsonBegin(UTestReporter* rep, int n)
+{
+    fprintf(rep->file, "{\"event\":\"start\",\"suite\":");
+    WriteJsonString(rep->file, SuiteName, strlen(SuiteName));
+    fprintf(rep->file, ",\"tests\":%d,\"seed\":%llu}\n", n, (unsigned long long)RunSeed());
+    fflush(rep->file);
+}
+
+static void JsonTest(UTestReporter* rep, UTestCase* test, const char* out, size_t out_len,
+                     const char* err, size_t err_len)
+{
+    FILE* f = rep->file;
+
+    fprintf(f, "{\"event\":\"test\",\"name\":");
+    WriteJsonString(f, test->name, strlen(test->name));
+    fprintf(f, ",\"status\":\"%s\",\"failures\":%d,\"wall_ns\":%llu,\"cpu_ns\":%llu,\"stdout\":",
+            TestStatus(test), test->status,
+            (unsigned long long)test->wall_ns, (unsigned long long)test->cpu_ns);
+    WriteJsonString(f, out != NULL ? out : "", out_len);
+    fprintf(f, ",\"stderr\":");
+    WriteJsonString(f, err != NULL ? err : "", err_len);
+    fprintf(f, "}\n");
+    fflush(f);
+}
+
+static void JsonEnd(UTestReporter* rep, int n, int failed)
+{
+    fprintf(rep->file, "{\"event\":\"end\",\"tests\":%d,\"failed\":%d}\n", n, failed);
+    fflush(rep->file);
+}
+
+static UTestReporter* NewReporter(FILE* f, void (*begin)(UTestReporter*, int),
+        void (*test)(UTestReporter*, UTestCase*, const char*, size_t, const char*, size_t),
+        void (*end)(UTestReporter*, int, int))
+{
+    UTestReporter* rep = InternalCalloc(1, sizeof(UTestReporter));
+    rep->file = f;
+    rep->begin = begin;
+    rep->test = test;
+    rep->end = end;
+    return rep;
+}
+
+UTestReporter* utest_junit_reporter(FILE* f)
+{
+    return NewReporter(f, JUnitBegin, JUnitTest, JUnitEnd);
+}
+
+UTestReporter* utest_json_reporter(FILE* f)
+{
+    return NewReporter(f, JsonBegin, JsonTest, JsonEnd);
+}
+
+/*
+ * Add the reporters from a comma separated list of FORMAT:FILE pairs, where
+ * FORMAT is junit or json and a FILE of - is stdout.
+ */
+static int OpenReports(const char* spec, const char* program)
+{
+    char buf[1024];
+    char* save = NULL;
+
+    if (program != NULL) {
+        const char* slash = strrchr(program, '/');
+        SuiteName = slash != NULL ? slash + 1 : program;
+    }
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (char* item = strtok_r(buf, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        char* path = strchr(item, ':');
+        UTestReporter* rep;
+        FILE* f;
+
+        if (path == NULL) {
+            fprintf(stderr, "utest: report '%s' should look like FORMAT:FILE\n", item);
+            return -1;
+        }
+        *path++ = '\0';
+        if (strcmp(item, "junit") != 0 && strcmp(item, "json") != 0) {
+            fprintf(stderr, "utest: unknown report format '%s'\n", item);
+            return -1;
+        }
+        if (n_Opened >= MAX_REPORTERS) {
+            fprintf(stderr, "utest: too many reporters\n");
+            return -1;
+        }
+        f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+        if (f == NULL) {
+            fprintf(stderr, "utest: couldn't open report file '%s': %s\n", path, strerror(errno));
+            return -1;
+        }
+        rep = strcmp(item, "junit") == 0 ? utest_junit_reporter(f) : utest_json_reporter(f);
+        Opened[n_Opened++] = rep;
+        if (utest_add_reporter(rep) != 0) {
+            fprintf(stderr, "utest: too many reporters\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Remove the reporters made by OpenReports, close their files and free them */
+static void CloseReports(void)
+{
+    for (int i = 0; i < n_Opened; i++)
+    {
+        UTestReporter* rep = Opened[i];
+        for (int k = 0; k < n_Reporters; k++) {
+            if (Reporters[k] == rep) {
+                memmove(Reporters + k, Reporters + k + 1, (n_Reporters - k - 1) * sizeof(rep));
+                n_Reporters--;
+                break;
+            }
+        }
+        if (rep->file == stdout)
+            fflush(stdout);
+        else
+            fclose(rep->file);
+        InternalFree(rep);
+    }
+    n_Opened = 0;
+}
+
+/*
+ * Test registry
+ *
+ * The TEST macro puts a pointer to a static UTestCase into the utest_cases
+ * section and the linker defines symbols for the start and end of it, so
+ * registering a test costs nothing at startup. Tests added at runtime with
+ * utest_build_testcase are kept in a separate growing array.
+ */
+
+extern UTestCase* __start_utest_cases[] __attribute__((weak));
+extern UTestCase* __stop_utest_cases[] __attribute__((weak));
+
+void utest_build_testcase(UTestCase opt, TestMethod tst, char *name) {
+    UTestCase* newtest = InternalMalloc(sizeof(UTestCase));
+    *newtest = opt;
+    newtest->name = name;
+    newtest->test = tst;
+    newtest->status = 0;
+    newtest->output = NULL;
+    newtest->wall_ns = 0;
+    newtest->cpu_ns = 0;
+
+    if (n_DynTests == cap_DynTests) {
+        cap_DynTests = cap_DynTests ? cap_DynTests * 2 : 64;
+        DynTests = (UTestCase**)InternalRealloc(DynTests, cap_DynTests * sizeof(UTestCase*));
+    }
+    DynTests[n_DynTests++] = newtest;
+}
+
+/* Gather the tests from the linker section and runtime registrations */
+static void CollectTests(void)
+{
+    size_t n_section = 0;
+    if (__start_utest_cases != NULL)
+        n_section = __stop_utest_cases - __start_utest_cases;
+
+    InternalFree(AllTests);
+    AllTests = (UTestCase**)InternalMalloc((n_section + n_DynTests + 1) * sizeof(UTestCase*));
+    if (n_section > 0)
+        memcpy(AllTests, __start_utest_cases, n_section * sizeof(UTestCase*));
+    if (n_DynTests > 0)
+        memcpy(AllTests + n_section, DynTests, n_DynTests * sizeof(UTestCase*));
+    n_Tests = n_section + n_DynTests;
+}
+
+static int CompareDurations(const void* a, const void* b)
+{
+    const UTestCase* l = *(UTestCase* const*)a;
+    const UTestCase* r = *(UTestCase* const*)b;
+    if (l->wall_ns != r->wall_ns)
+        return l->wall_ns < r->wall_ns ? 1 : -1;
+    return 0;
+}
+
+/* Print the `count` slowest tests, or all of them when `count` is zero */
+static void PrintDurations(UTestCase** tests, int n, int count)
+{
+    UTestCase** sorted = InternalMalloc((n + 1) * sizeof(UTestCase*));
+    memcpy(sorted, tests, n * sizeof(UTestCase*));
+    qsort(sorted, n, sizeof(UTestCase*), CompareDurations);
+
+    if (count == 0 || count > n)
+        count = n;
+    printf("\n\nSlowest tests:\n");
+    for (int i = 0; i < count; i++)
+        printf("%12.3fms wall %12.3fms cpu  TEST(%s)\n",
+               sorted[i]->wall_ns / 1e6, sorted[i]->cpu_ns / 1e6, sorted[i]->name);
+    InternalFree(sorted);
+}
+
+/*
+ * Filters
+ *
+ * A filter is a list of glob patterns separated by ':' or ','. A test is
+ * selected when its name matches any of the positive patterns (all tests if
+ * there are none) and none of the patterns that start with a '-'.
+ */
+static int MatchFilter(const char* filter, const char* name)
+{
+    char pattern[256];
+    int positive = 0, matched = 0;
+    const char* p = filter;
+
+    while (*p != '\0')
+    {
+        size_t len = strcspn(p, ":,");
+        int negative = (*p == '-');
+        const char* start = negative ? p + 1 : p;
+        size_t plen = negative ? len - 1 : len;
+
+        if (plen >= sizeof(pattern))
+            plen = sizeof(pattern) - 1;
+        memcpy(pattern, start, plen);
+        pattern[plen] = '\0';
+
+        if (plen > 0) {
+            int m = fnmatch(pattern, name, 0) == 0;
+            if (negative && m)
+                return 0;
+            if (!negative) {
+                positive = 1;
+                matched |= m;
+            }
+        }
+        p += len;
+        if (*p != '\0')
+            p++;
+    }
+    return !positive || matched;
+}
+
+/* Tests that match the filter and are the right kind for this run */
+static int TestSelected(UTestCase* test)
+{
+    if (!test->bench != !Options.bench)
+        return 0;
+    return Options.filter == NULL || MatchFilter(Options.filter, test->name);
+}
+
+static void ListTests(void)
+{
+    for (int i = 0; i < n_Tests; i++)
+        if (TestSelected(AllTests[i]))
+            printf("%s%s\n", AllTests[i]->name, AllTests[i]->ignore ? " (ignored)" : "");
+}
+
+/*
+ * Sharding
+ *
+ * Every shard runs the same selection of tests through the same assignment
+ * so they agree on who runs what without talking to each other. Without
+ * recorded durations a test goes to the shard given by a hash of its name.
+ * With durations from an earlier run (see SaveDurations) the tests are
+ * handed out longest first to the shard with the least work so far, tests
+ * missing from the file count as the average duration.
+ */
+
+struct utest_duration {
+    char* name;
+    uint64_t ns;
+    size_t line;
+};
+
+struct utest_shard_item {
+    UTestCase* test;
+    uint64_t hash;
+    uint64_t weight;
+    int order;
+};
+
+/* 64 bit FNV-1a */
+static uint64_t HashName(const char* s)
+{
+    uint64_t h = 14695981039346656037ull;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static int CompareDurationNames(const void* a, const void* b)
+{
+    return strcmp(((const struct utest_duration*)a)->name,
+                  ((const struct utest_duration*)b)->name);
+}
+
+static int CompareDurationLines(const void* a, const void* b)
+{
+    const struct utest_duration* l = a;
+    const struct utest_duration* r = b;
+    int cmp = strcmp(l->name, r->name);
+    if (cmp != 0)
+        return cmp;
+    return l->line < r->line ? -1 : l->line > r->line;
+}
+
+/* Read "<nanoseconds> <name>" lines sorted by name, later lines win */
+static struct utest_duration* LoadDurations(const char* path, size_t* count)
+{
+    FILE* f = fopen(path, "r");
+    struct utest_duration* d = NULL;
+    size_t n = 0, cap = 0, k = 0;
+    char name[1024];
+    unsigned long long ns;
+
+    *count = 0;
+    if (f == NULL)
+        return NULL;
+    while (fscanf(f, "%llu %1023s", &ns, name) == 2)
+    {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            d = InternalRealloc(d, cap * sizeof(struct utest_duration));
+        }
+        d[n].name = strdup(name);
+        d[n].ns = ns;
+        d[n].line = n;
+        n++;
+    }
+    fclose(f);
+
+    qsort(d, n, sizeof(struct utest_duration), CompareDurationLines);
+    for (size_t i = 0; i < n; i++) {
+        if (k > 0 && strcmp(d[k - 1].name, d[i].name) == 0) {
+            InternalFree(d[k - 1].name);
+            d[k - 1] = d[i];
+            continue;
+        }
+        d[k++] = d[i];
+    }
+    *count = k;
+    return d;
+}
+
+static void FreeDurations(struct utest_duration* d, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        InternalFree(d[i].name);
+    InternalFree(d);
+}
+
+static void SaveDurations(const char* path, UTestCase** tests, int n)
+{
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "couldn't write test durations to '%s'\n", path);
+        return;
+    }
+    for (int i = 0; i < n; i++)
+        fprintf(f, "%llu %s\n", (unsigned long long)tests[i]->wall_ns, tests[i]->name);
+    fclose(f);
+}
+
+/*
+ * Results cache
+ *
+ * The cache keeps the last result of every test as "<P|F> <build id>
+ * <nanoseconds> <name>" lines. --failed-first runs the tests that failed
+ * last time first, then the ones with no result yet, then the ones that
+ * passed in an older build, and last the ones that passed in this very
+ * binary since only flaky tests can change their result without a rebuild.
+ * --last-failed only runs the tests that failed. The build id is the one
+ * the linker put in the binary's GNU build-id note, or the size and mtime
+ * of the binary when there isn't one.
+ */
+
+struct utest_cached {
+    char* name;
+    char status;
+    char build[41];
+    unsigned long long ns;
+    size_t line;
+};
+
+enum { CACHE_FAILED, CACHE_NEW, CACHE_OLD_BUILD, CACHE_PASSED };
+
+#if UINTPTR_MAX > 0xffffffffu
+typedef Elf64_Phdr ut_phdr_t;
+typedef Elf64_Nhdr ut_nhdr_t;
+#else
+typedef Elf32_Phdr ut_phdr_t;
+typedef Elf32_Nhdr ut_nhdr_t;
+#endif
+
+/* Find the GNU build-id note in the program headers of the executable */
+static void FindBuildId(char* id)
+{
+    const ut_phdr_t* phdr = (const ut_phdr_t*)getauxval(AT_PHDR);
+    size_t phnum = getauxval(AT_PHNUM);
+    uintptr_t base = 0;
+
+    if (phdr == NULL)
+        return;
+    for (size_t i = 0; i < phnum; i++)
+        if (phdr[i].p_type == PT_PHDR)
+            base = (uintptr_t)phdr - phdr[i].p_vaddr;
+
+    for (size_t i = 0; i < phnum; i++)
+    {
+        const char* p = (const char*)(base + phdr[i].p_vaddr);
+        const char* end = p + phdr[i].p_memsz;
+
+        if (phdr[i].p_type != PT_NOTE)
+            continue;
+        while (p + sizeof(ut_nhdr_t) <= end) {
+            const ut_nhdr_t* note = (const ut_nhdr_t*)p;
+            const char* name = p + sizeof(ut_nhdr_t);
+            const unsigned char* desc = (const unsigned char*)name + ((note->n_namesz + 3) & ~3u);
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4
+                && memcmp(name, "GNU", 4) == 0) {
+                for (unsigned j = 0; j < note->n_descsz && j < 20; j++)
+                    sprintf(id + 2 * j, "%02x", desc[j]);
+                return;
+            }
+            p = (const char*)desc + ((note->n_descsz + 3) & ~3u);
+        }
+    }
+}
+
+static const char* BuildId(void)
+{
+    static char id[41];
+    struct stat st;
+
+    if (id[0] != '\0')
+        return id;
+    FindBuildId(id);
+    if (id[0] == '\0') {
+        if (stat("/proc/self/exe", &st) == 0)
+            snprintf(id, sizeof(id), "%llx-%llx", (unsigned long long)st.st_size,
+                     (unsigned long long)st.st_mtime);
+        else
+            snprintf(id, sizeof(id), "unknown");
+    }
+    return id;
+}
+
+static int CompareCached(const void* a, const void* b)
+{
+    return strcmp(((const struct utest_cached*)a)->name,
+                  ((const struct utest_cached*)b)->name);
+}
+
+static int CompareCachedLines(const void* a, const void* b)
+{
+    const struct utest_cached* l = a;
+    const struct utest_cached* r = b;
+    int cmp = strcmp(l->name, r->name);
+    if (cmp != 0)
+        return cmp;
+    return l->line < r->line ? -1 : l->line > r->line;
+}
+
+/* Read the cache sorted by name, later lines win */
+static struct utest_cached* LoadCache(const char* path, size_t* count)
+{
+    FILE* f = fopen(path, "r");
+    struct utest_cached* c = NULL;
+    size_t n = 0, cap = 0, k = 0;
+    char name[1024];
+
+    *count = 0;
+    if (f == NULL)
+        return NULL;
+    for (;;)
+    {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            c = InternalRealloc(c, cap * sizeof(struct utest_cached));
+        }
+        if (fscanf(f, " %c %40s %llu %1023s", &c[n].status, c[n].build, &c[n].ns, name) != 4)
+            break;
+        c[n].name = strdup(name);
+        c[n].line = n;
+        n++;
+    }
+    fclose(f);
+
+    qsort(c, n, sizeof(struct utest_cached), CompareCachedLines);
+    for (size_t i = 0; i < n; i++) {
+        if (k > 0 && strcmp(c[k - 1].name, c[i].name) == 0) {
+            InternalFree(c[k - 1].name);
+            c[k - 1] = c[i];
+            continue;
+        }
+        c[k++] = c[i];
+    }
+    *count = k;
+    return c;
+}
+
+static void FreeCache(struct utest_cached* c, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        InternalFree(c[i].name);
+    InternalFree(c);
+}
+
+static struct utest_cached* FindCached(struct utest_cached* c, size_t n, const char* name)
+{
+    struct utest_cached key = { .name = (char*)name };
+    return n > 0 ? bsearch(&key, c, n, sizeof(struct utest_cached), CompareCached) : NULL;
+}
+
+static int CacheRank(struct utest_cached* c, size_t n, UTestCase* test)
+{
+    struct utest_cached* e = FindCached(c, n, test->name);
+    if (e == NULL)
+        return CACHE_NEW;
+    if (e->status == 'F')
+        return CACHE_FAILED;
+    return strcmp(e->build, BuildId()) == 0 ? CACHE_PASSED : CACHE_OLD_BUILD;
+}
+
+/*
+ * Reorder the tests by their cached results, keeping the order they were
+ * registered in otherwise. With `only_failed` the tests that didn't fail
+ * last time are dropped, unless none did. Returns the number of tests left.
+ */
+static int OrderByCache(const char* path, UTestCase** tests, int n, int only_failed)
+{
+    size_t count;
+    struct utest_cached* c = LoadCache(path, &count);
+    UTestCase** sorted = InternalMalloc((n + 1) * sizeof(UTestCase*));
+    int k = 0;
+
+    for (int rank = CACHE_FAILED; rank <= CACHE_PASSED; rank++)
+        for (int i = 0; i < n; i++)
+            if (CacheRank(c, count, tests[i]) == rank)
+                sorted[k++] = tests[i];
+
+    if (only_failed) {
+        for (k = 0; k < n && CacheRank(c, count, sorted[k]) == CACHE_FAILED; k++)
+            ;
+        if (k == 0) {
+            printf("No failures in '%s', running every test\n", path);
+            k = n;
+        }
+    }
+    memcpy(tests, sorted, n * sizeof(UTestCase*));
+    InternalFree(sorted);
+    FreeCache(c, count);
+    return k;
+}
+
+/* Merge the results of `tests` into the cache */
+static void SaveCache(const char* path, UTestCase** tests, int n)
+{
+    size_t count;
+    struct utest_cached* c = LoadCache(path, &count);
+    char tmp[4096];
+    FILE* f;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if ((f = fopen(tmp, "w")) == NULL) {
+        fprintf(stderr, "couldn't write the results cache to '%s'\n", tmp);
+        FreeCache(c, count);
+        return;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        struct utest_cached* e = FindCached(c, count, tests[i]->name);
+        if (e != NULL)
+            e->status = 0;
+    }
+    for (size_t i = 0; i < count; i++)
+        if (c[i].status != 0)
+            fprintf(f, "%c %s %llu %s\n", c[i].status, c[i].build, c[i].ns, c[i].name);
+    for (int i = 0; i < n; i++)
+        fprintf(f, "%c %s %llu %s\n", tests[i]->status > 0 ? 'F' : 'P', BuildId(),
+                (unsigned long long)tests[i]->wall_ns, tests[i]->name);
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "couldn't write the results cache to '%s'\n", path);
+        unlink(tmp);
+    }
+    FreeCache(c, count);
+}
+
+static int CompareShardItems(const void* a, const void* b)
+{
+    const struct utest_shard_item* l = a;
+    const struct utest_shard_item* r = b;
+    if (l->weight != r->weight)
+        return l->weight < r->weight ? 1 : -1;
+    if (l->hash != r->hash)
+        return l->hash < r->hash ? -1 : 1;
+    return strcmp(l->test->name, r->test->name);
+}
+
+static int CompareShardOrder(const void* a, const void* b)
+{
+    return ((const struct utest_shard_item*)a)->order
+         - ((const struct utest_shard_item*)b)->order;
+}
+
+/*
+ * Keep only the tests that belong to shard `index` out of `total`, in their
+ * original order. Returns the new number of tests.
+ */
+static int ShardTests(UTestCase** tests, int n, int index, int total)
+{
+    struct utest_shard_item* items;
+    struct utest_duration* durations = NULL;
+    size_t n_durations = 0;
+    uint64_t* load;
+    int kept = 0;
+
+    if (Options.shard_durations != NULL)
+        durations = LoadDurations(Options.shard_durations, &n_durations);
+
+    if (n_durations == 0) {
+        for (int i = 0; i < n; i++)
+            if (HashName(tests[i]->name) % total == (uint64_t)index)
+                tests[kept++] = tests[i];
+        InternalFree(durations);
+        return kept;
+    }
+
+    items = InternalMalloc((n + 1) * sizeof(struct utest_shard_item));
+    load = InternalCalloc(total, sizeof(uint64_t));
+    {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n_durations; i++)
+            sum += durations[i].ns;
+        uint64_t mean = sum / n_durations + 1;
+
+        for (int i = 0; i < n; i++) {
+            struct utest_duration key = { tests[i]->name, 0, 0 };
+            struct utest_duration* d = bsearch(&key, durations, n_durations,
+                    sizeof(struct utest_duration), CompareDurationNames);
+            items[i].test = tests[i];
+            items[i].hash = HashName(tests[i]->name);
+            items[i].weight = d != NULL ? d->ns + 1 : mean;
+            items[i].order = i;
+        }
+    }
+
+    qsort(items, n, sizeof(struct utest_shard_item), CompareShardItems);
+    for (int i = 0; i < n; i++)
+    {
+        int best = 0;
+        for (int s = 1; s < total; s++)
+            if (load[s] < load[best])
+                best = s;
+        load[best] += items[i].weight;
+        if (best == index)
+            items[kept++] = items[i];
+    }
+    qsort(items, kept, sizeof(struct utest_shard_item), CompareShardOrder);
+    for (int i = 0; i < kept; i++)
+        tests[i] = items[i].test;
+
+    InternalFree(load);
+    InternalFree(items);
+    FreeDurations(durations, n_durations);
+    return kept;
+}
+
+static int PrintIgnored(void)
+{
+    int i, n = 0;
+    for (i = 0; i < n_Tests; i++) {
+        if (AllTests[i]->ignore && TestSelected(AllTests[i])) {
+            printf(COL_WARNING "Ignoring testcase: " COL_RESET "'%s'\n", AllTests[i]->name);
+            n++;
+        }
+    }
+    return n;
+}
+
+int assertion_failure(const char* fmt, ...)
+{
+    va_list args;
+    if (Quiet)
+        return 1;
+    va_start(args, fmt);
+    LogV(1, COL_ERROR "Assertion Failure:" COL_RESET " ", fmt, args);
+    va_end(args);
+    return 1;
+}
+
+int utest_warning(const char* fmt, ...)
+{
+    va_list args;
+    if (Quiet)
+        return 1;
+    va_start(args, fmt);
+    LogV(0, COL_WARNING "Test Warning:" COL_RESET " ", fmt, args);
+    va_end(args);
+    return 1;
+}
+
+/*
+ * Allocation tracking
+ *
+ * When utest is built with UTEST_TRACK_ALLOCS and the test binary is linked
+ * with -Wl,--wrap=malloc,--wrap=free,--wrap=calloc,--wrap=realloc every call
+ * to those functions goes through the wrappers below. They count the calls
+ * and the requested size of each block for the thread while it is running a
+ * test. The sizes are kept in a hash table keyed by address so a free can
+ * take back what its block added, frees of blocks from before the test (or
+ * from inside libc) don't change `live`. Allocations made by utest itself go
+ * through the Internal* helpers, which pause the counting, so they don't
+ * show up in the test's numbers.
+ */
+
+static __thread struct {
+    int active;
+    int paused;
+    ut_alloc_stats_t stats;
+} AllocTrack;
+
+#ifdef UTEST_TRACK_ALLOCS
+void* __real_malloc(size_t);
+void* __real_calloc(size_t, size_t);
+void* __real_realloc(void*, size_t);
+void __real_free(void*);
+
+struct utest_alloc_size {
+    void* p;
+    size_t size;
+};
+
+/* requested sizes of the blocks the current test holds, linear probing */
+static __thread struct {
+    struct utest_alloc_size* slots;
+    size_t mask;
+    size_t used;
+} AllocSizes;
+
+static inline int Tracking(void)
+{
+    return AllocTrack.active && !AllocTrack.paused;
+}
+
+static size_t AllocSlot(const void* p)
+{
+    return (size_t)(((uintptr_t)p >> 4) * 0x9E3779B97F4A7C15ull) & AllocSizes.mask;
+}
+
+static void PutAllocSize(void* p, size_t size)
+{
+    size_t i;
+    if (2 * (AllocSizes.used + 1) > AllocSizes.mask + 1 || AllocSizes.slots == NULL) {
+        struct utest_alloc_size* old = AllocSizes.slots;
+        size_t old_cap = old != NULL ? AllocSizes.mask + 1 : 0;
+        size_t cap = old_cap > 0 ? 2 * old_cap : 64;
+        struct utest_alloc_size* slots = __real_calloc(cap, sizeof(*slots));
+        if (slots == NULL)
+            return;
+        AllocSizes.slots = slots;
+        AllocSizes.mask = cap - 1;
+        AllocSizes.used = 0;
+        for (size_t k = 0; k < old_cap; k++)
+            if (old[k].p != NULL)
+                PutAllocSize(old[k].p, old[k].size);
+        __real_free(old);
+    }
+    for (i = AllocSlot(p); AllocSizes.slots[i].p != NULL; i = (i + 1) & AllocSizes.mask)
+        ;
+    AllocSizes.slots[i].p = p;
+    AllocSizes.slots[i].size = size;
+    AllocSizes.used++;
+}
+
+/* Remove `p` from the table, returns 1 and its size if it was there */
+static int TakeAllocSize(const void* p, size_t* size)
+{
+    size_t i, j;
+    if (AllocSizes.slots == NULL)
+        return 0;
+    for (i = AllocSlot(p); AllocSizes.slots[i].p != p; i = (i + 1) & AllocSizes.mask)
+        if (AllocSizes.slots[i].p == NULL)
+            return 0;
+    *size = AllocSizes.slots[i].size;
+    AllocSizes.used--;
+    /* shift the rest of the run back so lookups never stop at a hole */
+    for (j = (i + 1) & AllocSizes.mask; AllocSizes.slots[j].p != NULL; j = (j + 1) & AllocSizes.mask) {
+        size_t home = AllocSlot(AllocSizes.slots[j].p);
+        if (((j - home) & AllocSizes.mask) >= ((j - i) & AllocSizes.mask)) {
+            AllocSizes.slots[i] = AllocSizes.slots[j];
+            i = j;
+        }
+    }
+    AllocSizes.slots[i].p = NULL;
+    return 1;
+}
+
+static void ResetAllocSizes(void)
+{
+    __real_free(AllocSizes.slots);
+    AllocSizes.slots = NULL;
+    AllocSizes.mask = 0;
+    AllocSizes.used = 0;
+}
+
+static void CountAlloc(void* p, size_t size)
+{
+    ut_alloc_stats_t* s = &AllocTrack.stats;
+    s->allocs++;
+    s->bytes += size;
+    s->live += size;
+    if (s->live > s->peak)
+        s->peak = s->live;
+    PutAllocSize(p, size);
+}
+
+static void CountFree(void* p)
+{
+    size_t size;
+    AllocTrack.stats.frees++;
+    if (TakeAllocSize(p, &size))
+        AllocTrack.stats.live -= size;
+}
+
+void* __wrap_malloc(size_t size)
+{
+    void* p = __real_malloc(size);
+    if (p != NULL && Tracking())
+        CountAlloc(p, size);
+    return p;
+}
+
+void* __wrap_calloc(size_t n, size_t size)
+{
+    void* p = __real_calloc(n, size);
+    if (p != NULL && Tracking())
+        CountAlloc(p, n * size);
+    return p;
+}
+
+void* __wrap_realloc(void* old, size_t size)
+{
+    void* p = __real_realloc(old, size);
+    if (!Tracking())
+        return p;
+    /* realloc(old, 0) may free old and return NULL */
+    if (old != NULL && (p != NULL || size == 0))
+        CountFree(old);
+    if (p != NULL)
+        CountAlloc(p, size);
+    return p;
+}
+
+void __wrap_free(void* p)
+{
+    if (p != NULL && Tracking())
+        CountFree(p);
+    __real_free(p);
+}
+#endif /* UTEST_TRACK_ALLOCS */
+
+static void* InternalMalloc(size_t size)
+{
+    void* p;
+    AllocTrack.paused++;
+    p = malloc(size);
+    AllocTrack.paused--;
+    return p;
+}
+
+static void* InternalRealloc(void* old, size_t size)
+{
+    void* p;
+    AllocTrack.paused++;
+    p = realloc(old, size);
+    AllocTrack.paused--;
+    return p;
+}
+
+static void* InternalCalloc(size_t n, size_t size)
+{
+    void* p;
+    AllocTrack.paused++;
+    p = calloc(n, size);
+    AllocTrack.paused--;
+    return p;
+}
+
+static void InternalFree(void* p)
+{
+    AllocTrack.paused++;
+    free(p);
+    AllocTrack.paused--;
+}
+
+static void StartAllocTracking(void)
+{
+    memset(&AllocTrack.stats, 0, sizeof(AllocTrack.stats));
+    AllocTrack.active = 1;
+}
+
+static ut_alloc_stats_t StopAllocTracking(void)
+{
+    AllocTrack.active = 0;
+#ifdef UTEST_TRACK_ALLOCS
+    ResetAllocSizes();
+#endif
+    return AllocTrack.stats;
+}
+
+int utest_alloc_tracking(void)
+{
+#ifdef UTEST_TRACK_ALLOCS
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+ut_alloc_stats_t utest_alloc_stats(void)
+{
+    static int warned;
+    if (!utest_alloc_tracking() && !warned) {
+        warned = 1;
+        utest_warning("allocation tracking is off, build utest with "
+                      "-DUTEST_TRACK_ALLOCS and link with -Wl,--wrap=malloc,"
+                      "--wrap=free,--wrap=calloc,--wrap=realloc\n");
+    }
+    return AllocTrack.stats;
+}
+
+/* List the tests that left memory allocated after their teardown */
+static void PrintLeaks(UTestCase** tests, int n)
+{
+    int header = 0;
+    for (int i = 0; i < n; i++)
+    {
+        ut_alloc_stats_t* s = &tests[i]->alloc_stats;
+        if (s->live <= 0)
+            continue;
+        if (!header) {
+            printf("\n\nLeaks:\n");
+            header = 1;
+        }
+        printf("  TEST(%s) leaked %ld bytes, %zu allocations and %zu frees\n",
+               tests[i]->name, s->live, s->allocs, s->frees);
+    }
+}
+
+/*
+ * Output capture
+ *
+ * Captured output is written into an in-memory file (memfd) instead of a
+ * pipe, so a test can print any amount without blocking, and the file is
+ * mapped into memory once the capture ends so the buffer is never copied.
+ * Any file descriptor can be captured, and captures can be nested as long as
+ * captures of the same descriptor end in the reverse order they started.
+ * The mappings stay alive until the end of the test that made them, or
+ * until they are given to utest_capture_free.
+ */
+
+/* file descriptors are shared by every thread, so only one can capture them */
+static pthread_mutex_t CaptureLock = PTHREAD_MUTEX_INITIALIZER;
+
+struct utest_capture_map {
+    char* addr;
+    size_t len;
+    struct utest_capture_map* next;
+};
+
+static __thread struct utest_capture_map* CaptureMaps;
+
+/* Map the contents of `fd` and remember the mapping so it can be released */
+static char* MapCapture(int fd, size_t* len)
+{
+    struct utest_capture_map* m;
+    char* addr;
+
+    *len = FileSize(fd);
+    addr = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "couldn't map captured output\n");
+        *len = 0;
+        return NULL;
+    }
+
+    m = InternalMalloc(sizeof(struct utest_capture_map));
+    m->addr = addr;
+    m->len = *len;
+    m->next = CaptureMaps;
+    CaptureMaps = m;
+    return addr;
+}
+
+void utest_capture_free(char* buf)
+{
+    struct utest_capture_map** p = &CaptureMaps;
+    while (*p != NULL) {
+        struct utest_capture_map* m = *p;
+        if (m->addr == buf) {
+            *p = m->next;
+            munmap(m->addr, m->len);
+            InternalFree(m);
+            return;
+        }
+        p = &m->next;
+    }
+}
+
+/* Unmap every capture made by this thread */
+static void ReleaseCaptures(void)
+{
+    while (CaptureMaps != NULL) {
+        struct utest_capture_map* m = CaptureMaps;
+        CaptureMaps = m->next;
+        munmap(m->addr, m->len);
+        InternalFree(m);
+    }
+}
+
+/*
+ * The captures running on a thread, innermost first. A thread takes the
+ * capture lock when it starts its first capture and drops it when the last
+ * one ends since file descriptors are shared by the whole process.
+ */
+static __thread ut_capture_t* CaptureStack;
+
+static void FlushFd(int fd)
+{
+    if (fd == STDOUT_FILENO) {
+        DrainLog(0);
+        fflush(stdout);
+    } else if (fd == STDERR_FILENO) {
+        DrainLog(1);
+        fflush(stderr);
+    }
+}
+
+int utest_capture_begin(ut_capture_t* cap, int fd)
+{
+    int file_fd, saved_fd;
+
+    FlushFd(fd);
+    if (CaptureStack == NULL)
+        pthread_mutex_lock(&CaptureLock);
+
+    if ((file_fd = TempFd()) == -1) {
+        fprintf(stderr, "couldn't create output capture file\n");
+        goto Fail;
+    }
+    if ((saved_fd = dup(fd)) == -1) {
+        fprintf(stderr, "couldn't copy fd %d\n", fd);
+        close(file_fd);
+        goto Fail;
+    }
+    if (dup2(file_fd, fd) == -1) {
+        fprintf(stderr, "couldn't redirect fd %d to capture file\n", fd);
+        close(file_fd);
+        close(saved_fd);
+        goto Fail;
+    }
+
+    cap->fd = fd;
+    cap->saved_fd = saved_fd;
+    cap->file_fd = file_fd;
+    cap->active = 1;
+    cap->buf = NULL;
+    cap->len = 0;
+    cap->next = CaptureStack;
+    CaptureStack = cap;
+    return 0;
+
+Fail:
+    if (CaptureStack == NULL)
+        pthread_mutex_unlock(&CaptureLock);
+    return -1;
+}
+
+int utest_capture_end(ut_capture_t* cap)
+{
+    ut_capture_t** p = &CaptureStack;
+
+    while (*p != NULL && *p != cap) {
+        if ((*p)->fd == cap->fd) {
+            fprintf(stderr, "captures of fd %d must end in the reverse order they started\n", cap->fd);
+            return -1;
+        }
+        p = &(*p)->next;
+    }
+    if (*p == NULL || !cap->active)
+        return -1;
+    *p = cap->next;
+
+    FlushFd(cap->fd);
+    // always null terminated, which also means the mapping is never empty
+    if (write(cap->file_fd, "", 1) != 1)
+        fprintf(stderr, "couldn't terminate captured output\n");
+    dup2(cap->saved_fd, cap->fd);
+    close(cap->saved_fd);
+
+    cap->buf = MapCapture(cap->file_fd, &cap->len);
+    close(cap->file_fd);
+    cap->active = 0;
+    cap->saved_fd = cap->file_fd = -1;
+
+    if (CaptureStack == NULL)
+        pthread_mutex_unlock(&CaptureLock);
+    return 0;
+}
+
+int utest_capture_fd(ut_capture_t* cap, int fd, char** buf, size_t* len)
+{
+    if (!cap->active) {
+        if (utest_capture_begin(cap, fd) != 0)
+            exit(1);
+        return 1;
+    }
+    utest_capture_end(cap);
+    *buf = cap->buf;
+    *len = cap->len;
+    if (_current_test != NULL)
+        _current_test->output = cap->buf;
+    return 0;
+}
+
+int utest_capture_output(char **buf, size_t* len)
+{
+    static __thread ut_capture_t cap;
+    return utest_capture_fd(&cap, STDOUT_FILENO, buf, len);
+}
+
+/*
+ * Timeouts
+ *
+ * Tests that run in this process are watched by a watchdog thread. Every
+ * thread running tests has a watch slot with its current test and the time
+ * that test has to finish by. A stuck thread can't be stopped safely, so
+ * when a test runs past its deadline the watchdog prints the test's name
+ * and everything it has captured so far, then ends the process. Tests run
+ * by forked workers (-j or --isolate) are watched by the runner instead,
+ * which kills the worker and carries on with the next test.
+ */
+
+struct utest_watch {
+    UTestCase* test;
+    uint64_t deadline_ns;
+    int timeout_ms;
+    ut_capture_t** captures;
+    struct utest_log* logs;
+};
+
+static struct {
+    pthread_t tid;
+    int running;
+    int err_fd;
+    int n;
+    struct utest_watch* slots;
+} Watchdog;
+
+static __thread struct utest_watch* Watch;
+
+static int TestTimeout(UTestCase* test)
+{
+    return test->timeout_ms > 0 ? test->timeout_ms : Options.timeout_ms;
+}
+
+/* Watch the tests run by this thread in slot `i`, or nothing when NULL */
+static void UseWatch(struct utest_watch* slots, int i)
+{
+    Watch = slots != NULL ? &slots[i] : NULL;
+}
+
+static void ArmWatch(UTestCase* test)
+{
+    int timeout = TestTimeout(test);
+    if (Watch == NULL || timeout <= 0)
+        return;
+    Watch->test = test;
+    Watch->timeout_ms = timeout;
+    Watch->captures = &CaptureStack;
+    Watch->logs = Logs;
+    __atomic_store_n(&Watch->deadline_ns, MonotonicNs() + (uint64_t)timeout * 1000000,
+                     __ATOMIC_RELEASE);
+}
+
+static void DisarmWatch(void)
+{
+    if (Watch != NULL)
+        __atomic_store_n(&Watch->deadline_ns, 0, __ATOMIC_RELEASE);
+}
+
+/* Report a stuck test along with whatever it was capturing and exit */
+static void WatchdogFire(struct utest_watch* w)
+{
+    int fd = Watchdog.err_fd;
+
+    dprintf(fd, "\n" COL_ERROR "Timeout:" COL_RESET " TEST(%s) ran for more than %dms\n",
+            w->test->name, w->timeout_ms);
+    for (int i = 0; i < 2; i++)
+        if (w->logs[i].len > 0 && write(fd, w->logs[i].buf, w->logs[i].len) < 0)
+            break;
+    for (ut_capture_t* cap = *w->captures; cap != NULL; cap = cap->next)
+    {
+        if (!cap->active)
+            continue;
+        dprintf(fd, "output captured from fd %d so far:\n", cap->fd);
+        CopyFile(fd, cap->file_fd, FileSize(cap->file_fd));
+        dprintf(fd, "\n");
+    }
+    dprintf(fd, "run the tests with --isolate to fail stuck tests and keep going\n");
+    _exit(1);
+}
+
+static void* WatchdogLoop(void* arg __attribute__((unused)))
+{
+    struct timespec tick = { .tv_sec = 0, .tv_nsec = 5000000 };
+
+    while (__atomic_load_n(&Watchdog.running, __ATOMIC_ACQUIRE))
+    {
+        uint64_t now = MonotonicNs();
+        for (int i = 0; i < Watchdog.n; i++)
+        {
+            uint64_t deadline = __atomic_load_n(&Watchdog.slots[i].deadline_ns, __ATOMIC_ACQUIRE);
+            if (deadline != 0 && now > deadline)
+                WatchdogFire(&Watchdog.slots[i]);
+        }
+        nanosleep(&tick, NULL);
+    }
+    return NULL;
+}
+
+/* The watchdog thread doesn't survive a fork */
+static void WatchdogForked(void)
+{
+    Watchdog.running = 0;
+    Watchdog.slots = NULL;
+    Watch = NULL;
+}
+
+static void RegisterWatchdogFork(void)
+{
+    pthread_atfork(NULL, NULL, WatchdogForked);
+}
+
+/*
+ * Start the watchdog with `nslots` watch slots if any of the tests has a
+ * timeout, and give the calling thread the first slot. Runs started while
+ * the watchdog is already running are not watched.
+ */
+static struct utest_watch* StartWatchdog(UTestCase** tests, int n, int nslots)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    int timed = 0;
+
+    for (int i = 0; i < n && !timed; i++)
+        timed = TestTimeout(tests[i]) > 0;
+    if (!timed || Watchdog.running)
+        return NULL;
+    pthread_once(&once, RegisterWatchdogFork);
+
+    Watchdog.slots = InternalCalloc(nslots, sizeof(struct utest_watch));
+    Watchdog.n = nslots;
+    Watchdog.err_fd = dup(STDERR_FILENO);
+    Watchdog.running = 1;
+    if (pthread_create(&Watchdog.tid, NULL, WatchdogLoop, NULL) != 0) {
+        fprintf(stderr, "couldn't start the watchdog thread, timeouts are off\n");
+        Watchdog.running = 0;
+        close(Watchdog.err_fd);
+        InternalFree(Watchdog.slots);
+        return NULL;
+    }
+    Watch = &Watchdog.slots[0];
+    return Watchdog.slots;
+}
+
+static void StopWatchdog(struct utest_watch* slots)
+{
+    if (slots == NULL)
+        return;
+    __atomic_store_n(&Watchdog.running, 0, __ATOMIC_RELEASE);
+    pthread_join(Watchdog.tid, NULL);
+    close(Watchdog.err_fd);
+    InternalFree(Watchdog.slots);
+    Watchdog.slots = NULL;
+    Watch = NULL;
+}
+
+/*
+ * Memory comparison
+ *
+ * binary_mismatch picks the widest vector compare the cpu supports the first
+ * time it is called. Each version compares whole vectors until one has a
+ * byte that differs and then finds that byte from the compare mask.
+ */
+
+static size_t MismatchScalar(const byte_t* l, const byte_t* r, size_t len)
+{
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, l + i, 8);
+        memcpy(&b, r + i, 8);
+        if (a != b)
+            break;
+    }
+    for (; i < len; i++)
+        if (l[i] != r[i])
+            return i;
+    return len;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static size_t MismatchSSE2(const byte_t* l, const byte_t* r, size_t len)
+{
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(l + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(r + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+        if (mask != 0xffff)
+            return i + __builtin_ctz(~mask);
+    }
+    return i + MismatchScalar(l + i, r + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t MismatchAVX2(const byte_t* l, const byte_t* r, size_t len)
+{
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i*)(l + i));
+        __m256i b0 = _mm256_loadu_si256((const __m256i*)(r + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i*)(l + i + 32));
+        __m256i b1 = _mm256_loadu_si256((const __m256i*)(r + i + 32));
+        __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(a0, b0),
+                                      _mm256_cmpeq_epi8(a1, b1));
+        if ((unsigned int)_mm256_movemask_epi8(eq) != 0xffffffffu)
+            break;
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(l + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(r + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+        if (mask != 0xffffffffu)
+            return i + __builtin_ctz(~mask);
+    }
+    return i + MismatchSSE2(l + i, r + i, len - i);
+}
+#endif
+
+typedef size_t (*MismatchFunc)(const byte_t*, const byte_t*, size_t);
+
+static MismatchFunc SelectMismatch(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return MismatchAVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return MismatchSSE2;
+#endif
+    return MismatchScalar;
+}
+
+size_t binary_mismatch(const void* left, const void* right, size_t len)
+{
+    static MismatchFunc mismatch;
+    if (mismatch == NULL)
+        mismatch = SelectMismatch();
+    return mismatch(left, right, len);
+}
+
+/**
+ * Return: 1 for a match, 0 for not the same.
+ */
+int binary_compare(byte_t* left, byte_t* right, size_t len) {
+    return binary_mismatch(left, right, len) == len;
+}
+
+static void HexDumpRow(char side, const byte_t* row, const byte_t* other,
+                       size_t start, size_t end, size_t len)
+{
+    LogPrintf(1, "  %c %08zx ", side, start);
+    for (size_t i = start; i < end; i++) {
+        if (i >= len)
+            LogPrintf(1, "   ");
+        else if (row[i - start] != other[i - start])
+            LogPrintf(1, COL_ERROR " %02x" COL_RESET, row[i - start]);
+        else
+            LogPrintf(1, " %02x", row[i - start]);
+    }
+    LogPrintf(1, "  |");
+    for (size_t i = start; i < end && i < len; i++)
+        LogPrintf(1, "%c", isprint(row[i - start]) ? row[i - start] : '.');
+    LogPrintf(1, "|\n");
+}
+
+int utest_eqn_failure(const char* file, int line, const char* expr,
+                      const void* left, const void* right, size_t len, size_t offset)
+{
+    const byte_t* l = left;
+    const byte_t* r = right;
+    size_t start = offset & ~(size_t)15;
+    size_t end;
+
+    start = start >= 32 ? start - 32 : 0;
+    end = start + 5 * 16;
+    if (end > ((len + 15) & ~(size_t)15))
+        end = (len + 15) & ~(size_t)15;
+
+    assertion_failure("TEST(%s) %s:%d '%s' first difference at byte %zu of %zu\n",
+                      _current_test != NULL ? _current_test->name : "?",
+                      file, line, expr, offset, len);
+    if (Quiet)
+        return 1;
+    for (size_t row = start; row < end; row += 16) {
+        HexDumpRow('<', l + row, r + row, row, row + 16, len);
+        HexDumpRow('>', r + row, l + row, row, row + 16, len);
+    }
+    return 1;
+}
+
+/*
+ * Value comparison
+ *
+ * Floats and doubles are mapped to integers that are ordered the same way
+ * and one apart for neighbouring values, so the distance between those
+ * integers is the distance in ulps. Long doubles have no portable layout
+ * and are compared against a multiple of LDBL_EPSILON relative to the
+ * larger of the two values instead.
+ */
+
+static uint64_t UlpDistance(int64_t a, int64_t b)
+{
+    return a > b ? (uint64_t)a - (uint64_t)b : (uint64_t)b - (uint64_t)a;
+}
+
+/* negative values are stored as sign and magnitude, turn them into -magnitude */
+static int64_t FloatBits(float f)
+{
+    int32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits < 0 ? (int64_t)INT32_MIN - bits : bits;
+}
+
+static int64_t DoubleBits(double d)
+{
+    int64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return bits < 0 ? INT64_MIN - bits : bits;
+}
+
+int utest_value_eq(const void* left, const void* right, int kind, int max_ulps)
+{
+    switch (kind) {
+    case UT_KIND_STR:
+        return strcomp(*(char**)left, *(char**)right) == 0;
+    case UT_KIND_FLOAT: {
+        float a = *(const float*)left, b = *(const float*)right;
+        if (isnan(a) || isnan(b) || isinf(a) || isinf(b))
+            return 0;
+        return UlpDistance(FloatBits(a), FloatBits(b)) <= (uint64_t)max_ulps;
+    }
+    case UT_KIND_DOUBLE: {
+        double a = *(const double*)left, b = *(const double*)right;
+        if (isnan(a) || isnan(b) || isinf(a) || isinf(b))
+            return 0;
+        return UlpDistance(DoubleBits(a), DoubleBits(b)) <= (uint64_t)max_ulps;
+    }
+    case UT_KIND_LDOUBLE: {
+        long double a = *(const long double*)left, b = *(const long double*)right;
+        long double diff = a > b ? a - b : b - a;
+        long double scale = a < 0 ? -a : a;
+        if (isnan(a) || isnan(b) || isinf(a) || isinf(b))
+            return 0;
+        if ((b < 0 ? -b : b) > scale)
+            scale = b < 0 ? -b : b;
+        return diff <= max_ulps * LDBL_EPSILON * scale;
+    }
+    }
+    return 0;
+}
+
+static void PrintValue(const char* side, int kind, size_t size, const void* value)
+{
+    LogPrintf(1, "    %s ", side);
+    switch (kind) {
+    case UT_KIND_INT: {
+        long long v = size == 1 ? *(const signed char*)value
+                    : size == 2 ? *(const short*)value
+                    : size == 4 ? *(const int32_t*)value
+                    : *(const long long*)value;
+        LogPrintf(1, "%lld\n", v);
+        break;
+    }
+    case UT_KIND_UINT: {
+        unsigned long long v = size == 1 ? *(const unsigned char*)value
+                             : size == 2 ? *(const unsigned short*)value
+                             : size == 4 ? *(const uint32_t*)value
+                             : *(const unsigned long long*)value;
+        LogPrintf(1, "%llu (0x%llx)\n", v, v);
+        break;
+    }
+    case UT_KIND_PTR:
+        LogPrintf(1, "%p\n", *(void* const*)value);
+        break;
+    case UT_KIND_STR:
+        if (*(char* const*)value == NULL)
+            LogPrintf(1, "NULL\n");
+        else
+            LogPrintf(1, "\"%s\"\n", *(char* const*)value);
+        break;
+    case UT_KIND_FLOAT:
+        LogPrintf(1, "%.9g\n", *(const float*)value);
+        break;
+    case UT_KIND_DOUBLE:
+        LogPrintf(1, "%.17g\n", *(const double*)value);
+        break;
+    case UT_KIND_LDOUBLE:
+        LogPrintf(1, "%.21Lg\n", *(const long double*)value);
+        break;
+    }
+}
+
+int utest_eq_failure(const char* file, int line, const char* expr,
+                     int kind, size_t size, const void* left, const void* right)
+{
+    assertion_failure("TEST(%s) %s:%d '%s'\n",
+                      _current_test != NULL ? _current_test->name : "?", file, line, expr);
+    if (Quiet)
+        return 1;
+    PrintValue("left: ", kind, size, left);
+    PrintValue("right:", kind, size, right);
+    if (kind == UT_KIND_FLOAT && isfinite(*(const float*)left) && isfinite(*(const float*)right))
+        LogPrintf(1, "    %llu ulps apart\n", (unsigned long long)UlpDistance(
+                  FloatBits(*(const float*)left), FloatBits(*(const float*)right)));
+    else if (kind == UT_KIND_DOUBLE && isfinite(*(const double*)left)
+             && isfinite(*(const double*)right))
+        LogPrintf(1, "    %llu ulps apart\n", (unsigned long long)UlpDistance(
+                  DoubleBits(*(const double*)left), DoubleBits(*(const double*)right)));
+    return 1;
+}
+
+/*
+ * Unordered (multiset) comparison
+ *
+ * Every element of the first array adds one to its count in an open
+ * addressing hash table and every element of the second array takes one
+ * away, the arrays hold the same elements when all counts end at zero.
+ * Elements are either strings (size 0) or compared byte for byte.
+ */
+
+struct utest_multiset_slot {
+    const void* key;
+    uint64_t hash;
+    long count;
+};
+
+struct utest_multiset {
+    struct utest_multiset_slot* slots;
+    size_t mask;
+    size_t size; /* element size, 0 for strings */
+};
+
+static uint64_t HashBytes(const void* p, size_t len)
+{
+    const byte_t* b = p;
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= b[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static const void* MultisetKey(const struct utest_multiset* m, const void* arr, size_t i)
+{
+    if (m->size == 0)
+        return ((char* const*)arr)[i];
+    return (const byte_t*)arr + i * m->size;
+}
+
+static struct utest_multiset_slot* MultisetFind(struct utest_multiset* m, const void* key)
+{
+    uint64_t h = m->size == 0 ? HashName(key) : HashBytes(key, m->size);
+    size_t i = h & m->mask;
+
+    for (;; i = (i + 1) & m->mask) {
+        struct utest_multiset_slot* slot = &m->slots[i];
+        if (slot->key == NULL) {
+            slot->key = key;
+            slot->hash = h;
+            return slot;
+        }
+        if (slot->hash == h && (m->size == 0
+                ? strcmp(slot->key, key) == 0
+                : memcmp(slot->key, key, m->size) == 0))
+            return slot;
+    }
+}
+
+/*
+ * Count the elements of `a1` minus those of `a2`. Stops early at the first
+ * difference unless `complete` is set. Returns 1 when they are the same.
+ */
+static int MultisetCount(struct utest_multiset* m, const void* a1, const void* a2,
+                         size_t len, size_t size, int complete)
+{
+    size_t cap = 16;
+    int same = 1;
+
+    while (cap < 2 * len)
+        cap <<= 1;
+    m->slots = InternalCalloc(cap, sizeof(struct utest_multiset_slot));
+    m->mask = cap - 1;
+    m->size = size;
+
+    for (size_t i = 0; i < len; i++)
+        MultisetFind(m, MultisetKey(m, a1, i))->count++;
+    for (size_t i = 0; i < len; i++) {
+        if (--MultisetFind(m, MultisetKey(m, a2, i))->count < 0) {
+            same = 0;
+            if (!complete)
+                break;
+        }
+    }
+    return same;
+}
+
+int arr_unordered_eq_n(const void* a1, const void* a2, size_t len, size_t size)
+{
+    struct utest_multiset m;
+    int same = MultisetCount(&m, a1, a2, len, size, 0);
+    InternalFree(m.slots);
+    return same;
+}
+
+int arr_unordered_eq_s(char** a1, char** a2, size_t len)
+{
+    return arr_unordered_eq_n(a1, a2, len, 0);
+}
+
+static void PrintElement(const struct utest_multiset* m, const void* key)
+{
+    if (m->size == 0) {
+        LogPrintf(1, "\"%s\"", (const char*)key);
+        return;
+    }
+    LogPrintf(1, "0x");
+    for (size_t i = 0; i < m->size; i++)
+        LogPrintf(1, "%02x", ((const byte_t*)key)[i]);
+}
+
+/* Print up to 10 elements whose count has the sign of `sign` */
+static void PrintExtraElements(const struct utest_multiset* m, const char* which, int sign)
+{
+    size_t shown = 0, total = 0;
+    LogPrintf(1, "  only in %s:", which);
+    for (size_t i = 0; i <= m->mask; i++) {
+        const struct utest_multiset_slot* slot = &m->slots[i];
+        if (slot->key == NULL || slot->count * sign <= 0)
+            continue;
+        total++;
+        if (shown++ >= 10)
+            continue;
+        LogPrintf(1, " ");
+        PrintElement(m, slot->key);
+        if (slot->count * sign > 1)
+            LogPrintf(1, " (x%ld)", slot->count * sign);
+    }
+    if (total > 10)
+        LogPrintf(1, " ... %zu more", total - 10);
+    LogPrintf(1, "\n");
+}
+
+int utest_unordered_failure(const char* file, int line, const char* a_expr, const char* b_expr,
+                            const void* a1, const void* a2, size_t len, size_t size)
+{
+    struct utest_multiset m;
+    MultisetCount(&m, a1, a2, len, size, 1);
+
+    assertion_failure("TEST(%s) %s:%d '%s' and '%s' do not have the same elements\n",
+                      _current_test != NULL ? _current_test->name : "?",
+                      file, line, a_expr, b_expr);
+    if (!Quiet) {
+        PrintExtraElements(&m, a_expr, 1);
+        PrintExtraElements(&m, b_expr, -1);
+    }
+    InternalFree(m.slots);
+    return 1;
+}
+
+#define _ARR_EQ_IMPL(SUFFIX, TYPE)                                \
+int arr_eq_##SUFFIX(TYPE *arr1, TYPE *arr2, size_t len) {         \
+    for (size_t i = 0; i < len; i++)                              \
+        if (arr1[i] != arr2[i])                                   \
+            return 0;                                             \
+    return 1;                                                     \
+}
+
+#define _ARR_UNORDERED_IMPL(SUFFIX, TYPE)                         \
+int arr_unordered_eq_##SUFFIX(TYPE *a1, TYPE *a2, size_t len) {   \
+    return arr_unordered_eq_n(a1, a2, len, sizeof(TYPE));         \
+}
+
+/*
+ * Floats go by value like arr_eq_f and arr_eq_d: a NaN matches nothing and
+ * both arrays are copied with -0 turned into 0 before the bytes are hashed.
+ */
+#define _ARR_UNORDERED_FLOAT_IMPL(SUFFIX, TYPE)                   \
+int arr_unordered_eq_##SUFFIX(TYPE *a1, TYPE *a2, size_t len) {   \
+    TYPE* copy;                                                   \
+    int same;                                                     \
+    for (size_t i = 0; i < len; i++)                              \
+        if (isnan(a1[i]) || isnan(a2[i]))                         \
+            return 0;                                             \
+    copy = InternalMalloc(2 * len * sizeof(TYPE) + 1);            \
+    for (size_t i = 0; i < len; i++) {                            \
+        copy[i] = a1[i] == 0 ? 0 : a1[i];                         \
+        copy[len + i] = a2[i] == 0 ? 0 : a2[i];                   \
+    }                                                             \
+    same = arr_unordered_eq_n(copy, copy + len, len, sizeof(TYPE)); \
+    InternalFree(copy);                                           \
+    return same;                                                  \
+}
+
+_ARR_EQ_IMPL(c, char)
+_ARR_EQ_IMPL(i, int)
+_ARR_EQ_IMPL(u, unsigned int)
+_ARR_EQ_IMPL(l, long)
+_ARR_EQ_IMPL(ul, unsigned long)
+_ARR_EQ_IMPL(f, float)
+_ARR_EQ_IMPL(d, double)
+_ARR_UNORDERED_IMPL(c, char)
+_ARR_UNORDERED_IMPL(i, int)
+_ARR_UNORDERED_IMPL(u, unsigned int)
+_ARR_UNORDERED_IMPL(l, long)
+_ARR_UNORDERED_IMPL(ul, unsigned long)
+_ARR_UNORDERED_FLOAT_IMPL(f, float)
+_ARR_UNORDERED_FLOAT_IMPL(d, double)
+
+#undef _ARR_EQ_IMPL
+#undef _ARR_UNORDERED_IMPL
+#undef _ARR_UNORDERED_FLOAT_IMPL
+
+int arr_eq_s(char** arr1, char** arr2, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (strcmp(arr1[i], arr2[i]) != 0)
+            return 0;
+    return 1;
+}
+
+int strcomp(char* one, char* two) {
+    if (one == two)
+        return 0;
+    if (one == NULL || two == NULL)
+        return 1;
+    return strcmp(one, two) != 0;
+}
+
+int str_arr_contains(char** arr, size_t len, char* str)
+{
+    size_t i;
+    for (i = 0; i < len; i++)
+    {
+        if (strcmp(str, arr[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Random data
+ *
+ * xoshiro256** seeded through splitmix64. Every test gets its own generator
+ * seeded from the run's seed and the test's name, so a test sees the same
+ * numbers no matter which tests ran before it, on which thread or in which
+ * shard. A failing test that used its generator prints the run's seed and
+ * UTEST_SEED or --seed replay it.
+ */
+
+static char character_set[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789,.-#'?!";
+
+static uint64_t SplitMix64(uint64_t* x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t RotateLeft(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+void ut_rand_seed(ut_rand_t* rng, uint64_t seed)
+{
+    uint64_t x = seed;
+    rng->seed = seed;
+    for (int i = 0; i < 4; i++)
+        rng->s[i] = SplitMix64(&x);
+}
+
+uint64_t ut_rand_next(ut_rand_t* rng)
+{
+    uint64_t* s = rng->s;
+    uint64_t result = RotateLeft(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = RotateLeft(s[3], 45);
+    return result;
+}
+
+uint64_t ut_rand_below(ut_rand_t* rng, uint64_t n)
+{
+#ifdef __SIZEOF_INT128__
+    /* Lemire's multiply and shift with rejection of the biased low range */
+    unsigned __int128 m;
+    uint64_t low;
+
+    if (n == 0)
+        return 0;
+    m = (unsigned __int128)ut_rand_next(rng) * n;
+    low = (uint64_t)m;
+    if (low < n) {
+        uint64_t threshold = -n % n;
+        while (low < threshold) {
+            m = (unsigned __int128)ut_rand_next(rng) * n;
+            low = (uint64_t)m;
+        }
+    }
+    return (uint64_t)(m >> 64);
+#else
+    /* no 128 bit multiply, reject the 2^64 % n lowest values and take the rest mod n */
+    uint64_t threshold, x;
+
+    if (n == 0)
+        return 0;
+    threshold = -n % n;
+    do
+        x = ut_rand_next(rng);
+    while (x < threshold);
+    return x % n;
+#endif
+}
+
+void ut_rand_bytes(ut_rand_t* rng, void* buf, size_t len)
+{
+    byte_t* p = buf;
+    uint64_t x;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        x = ut_rand_next(rng);
+        memcpy(p, &x, 8);
+    }
+    if (len > 0) {
+        x = ut_rand_next(rng);
+        memcpy(p, &x, len);
+    }
+}
+
+/* Fail the current test when a range is empty, returns 1 when it did */
+static int BadRange(const char* fn, long long min, long long max)
+{
+    if (min <= max)
+        return 0;
+    assertion_failure("TEST(%s) %s called with min %lld greater than max %lld\n",
+                      _current_test != NULL ? _current_test->name : "?", fn, min, max);
+    if (_current_test != NULL)
+        _current_test->status++;
+    return 1;
+}
+
+void ut_rand_ints(ut_rand_t* rng, int* out, size_t n, int min, int max)
+{
+    uint64_t span;
+    if (BadRange("ut_rand_ints", min, max))
+        return;
+    span = (uint64_t)((int64_t)max - min) + 1;
+    for (size_t i = 0; i < n; i++)
+        out[i] = (int)((int64_t)min + (int64_t)ut_rand_below(rng, span));
+}
+
+/* Fill `len` characters from the character set, two per random number */
+static void RandomChars(ut_rand_t* rng, char* out, size_t len)
+{
+    const uint64_t n = sizeof(character_set) - 1;
+    size_t k = 0;
+    for (; k + 2 <= len; k += 2) {
+        uint64_t x = ut_rand_next(rng);
+        out[k] = character_set[((x & 0xffffffff) * n) >> 32];
+        out[k + 1] = character_set[((x >> 32) * n) >> 32];
+    }
+    if (k < len)
+        out[k] = character_set[((ut_rand_next(rng) >> 32) * n) >> 32];
+}
+
+/* Lay out `n` strings of length `len` after their pointer array in `block` */
+static char** RandomStringsInto(ut_rand_t* rng, void* block, size_t n, size_t len)
+{
+    char** list = block;
+    char* chars = (char*)(list + n);
+
+    RandomChars(rng, chars, n * (len + 1));
+    for (size_t i = 0; i < n; i++) {
+        list[i] = chars + i * (len + 1);
+        list[i][len] = '\0';
+    }
+    return list;
+}
+
+/* Bytes for `n` pointers and `n` strings of `len`, returns 0 on overflow */
+static int StringsSize(size_t n, size_t len, size_t* size)
+{
+    return !__builtin_add_overflow(len, sizeof(char*) + 1, size)
+        && !__builtin_mul_overflow(n, *size, size);
+}
+
+char** ut_rand_strings(ut_rand_t* rng, size_t n, size_t len)
+{
+    size_t size;
+    char** list;
+    if (!StringsSize(n, len, &size) || (list = malloc(size)) == NULL)
+        return NULL;
+    return RandomStringsInto(rng, list, n, len);
+}
+
+char** utest_random_strings(size_t n, size_t len)
+{
+    size_t size;
+    char** list;
+    if (!StringsSize(n, len, &size) || (list = utest_alloc(size)) == NULL)
+        return NULL;
+    return RandomStringsInto(utest_rand(), list, n, len);
+}
+
+static uint64_t RunSeed(void)
+{
+    static uint64_t seed;
+    static int set;
+    if (!set) {
+        seed = Options.seed_set ? Options.seed : MonotonicNs() ^ ((uint64_t)getpid() << 32);
+        set = 1;
+    }
+    return seed;
+}
+
+/* The generator of the test running on this thread, seeded on first use */
+static __thread ut_rand_t TestRand;
+static __thread UTestCase* TestRandOwner;
+static __thread int TestRandSeeded;
+
+ut_rand_t* utest_rand(void)
+{
+    if (!TestRandSeeded || TestRandOwner != _current_test) {
+        uint64_t seed = RunSeed();
+        if (_current_test != NULL)
+            seed ^= HashName(_current_test->name);
+        ut_rand_seed(&TestRand, seed);
+        TestRandOwner = _current_test;
+        TestRandSeeded = 1;
+    }
+    return &TestRand;
+}
+
+/* Called after a test ran, mentions the seed if it failed using random data */
+static void ReportSeed(UTestCase* test)
+{
+    if (TestRandSeeded && TestRandOwner == test && test->status > 0)
+        LogPrintf(1, COL_WARNING "Random Seed:" COL_RESET
+                " TEST(%s) used random data, rerun with UTEST_SEED=%llu\n",
+                test->name, (unsigned long long)RunSeed());
+    TestRandSeeded = 0;
+    TestRandOwner = NULL;
+}
+
+/*
+ * Property based testing
+ *
+ * A property is a test body that gets its input from a generator and is run
+ * on many generated inputs. Every value a generator hands out is drawn as a
+ * number from a choice sequence, so any input can be replayed from the
+ * sequence alone. Cases are spread over a pool of threads, each case seeded
+ * from the run's seed, the test's name and the case number, and the lowest
+ * failing case wins so a failure doesn't depend on scheduling. That case is
+ * shrunk on the calling thread by deleting runs of choices and lowering
+ * single choices while the property still fails, smaller being shorter and
+ * then lexicographically smaller. Choices past the end of a sequence are 0,
+ * and generators map 0 to their simplest value. The shrunk case is finally
+ * run once more where its assertions and the generated values are printed.
+ */
+
+#define PROP_MAX_CHOICES  (1 << 16)
+#define PROP_SHRINK_TRIES 10000
+
+struct utest_gen {
+    uint64_t* choices;
+    size_t len;     /* choices recorded or given to replay */
+    size_t pos;     /* choices drawn by this case */
+    size_t cap;
+    int random;     /* draw past the end from rng instead of returning 0 */
+    int verbose;    /* log the generated values with the assertions */
+    ut_rand_t rng;
+    void** allocs;
+    size_t n_allocs;
+};
+
+/* Draw a choice in [0, n), n = 0 draws from the whole 64 bit range */
+static uint64_t Draw(ut_gen_t* gen, uint64_t n)
+{
+    uint64_t v = 0;
+
+    if (gen->pos >= PROP_MAX_CHOICES)
+        return 0;
+    if (gen->pos < gen->len)
+        v = n > 0 ? gen->choices[gen->pos] % n : gen->choices[gen->pos];
+    else if (gen->random)
+        v = n > 0 ? ut_rand_below(&gen->rng, n) : ut_rand_next(&gen->rng);
+
+    if (gen->pos >= gen->cap) {
+        gen->cap = gen->cap ? gen->cap * 2 : 64;
+        gen->choices = InternalRealloc(gen->choices, gen->cap * sizeof(uint64_t));
+    }
+    gen->choices[gen->pos++] = v;
+    if (gen->pos > gen->len)
+        gen->len = gen->pos;
+    return v;
+}
+
+uint64_t ut_gen_below(ut_gen_t* gen, uint64_t n)
+{
+    uint64_t v = Draw(gen, n > 0 ? n : 1);
+    if (gen->verbose)
+        LogPrintf(1, "  gen: %llu\n", (unsigned long long)v);
+    return v;
+}
+
+int64_t ut_gen_int(ut_gen_t* gen, int64_t min, int64_t max)
+{
+    /* wraps to 0 for the full range, which Draw takes as all 64 bits */
+    uint64_t span = (uint64_t)max - (uint64_t)min + 1;
+    int64_t v;
+
+    if (BadRange("ut_gen_int", min, max))
+        return min;
+    v = (int64_t)((uint64_t)min + Draw(gen, span));
+    if (gen->verbose)
+        LogPrintf(1, "  gen int: %lld\n", (long long)v);
+    return v;
+}
+
+int ut_gen_bool(ut_gen_t* gen)
+{
+    int v = (int)Draw(gen, 2);
+    if (gen->verbose)
+        LogPrintf(1, "  gen bool: %d\n", v);
+    return v;
+}
+
+double ut_gen_double(ut_gen_t* gen, double min, double max)
+{
+    double v = min + (max - min) * (Draw(gen, 1ull << 53) / 9007199254740992.0);
+    if (gen->verbose)
+        LogPrintf(1, "  gen double: %.17g\n", v);
+    return v;
+}
+
+void* ut_gen_alloc(ut_gen_t* gen, size_t size)
+{
+    void* p = InternalMalloc(size > 0 ? size : 1);
+    gen->allocs = InternalRealloc(gen->allocs, (gen->n_allocs + 1) * sizeof(void*));
+    gen->allocs[gen->n_allocs++] = p;
+    return p;
+}
+
+int* ut_gen_ints(ut_gen_t* gen, size_t* n, size_t max_n, int min, int max)
+{
+    int* out;
+    if (BadRange("ut_gen_ints", min, max)) {
+        *n = 0;
+        return ut_gen_alloc(gen, 0);
+    }
+    *n = Draw(gen, max_n + 1);
+    out = ut_gen_alloc(gen, *n * sizeof(int));
+    for (size_t i = 0; i < *n; i++)
+        out[i] = (int)((int64_t)min + (int64_t)Draw(gen, (uint64_t)((int64_t)max - min) + 1));
+    if (gen->verbose) {
+        LogPrintf(1, "  gen ints: {");
+        for (size_t i = 0; i < *n; i++)
+            LogPrintf(1, i ? ", %d" : "%d", out[i]);
+        LogPrintf(1, "}\n");
+    }
+    return out;
+}
+
+void* ut_gen_bytes(ut_gen_t* gen, size_t* len, size_t max_len)
+{
+    byte_t* out;
+    *len = Draw(gen, max_len + 1);
+    out = ut_gen_alloc(gen, *len);
+    for (size_t i = 0; i < *len; i++)
+        out[i] = (byte_t)Draw(gen, 256);
+    if (gen->verbose) {
+        LogPrintf(1, "  gen bytes:");
+        for (size_t i = 0; i < *len; i++)
+            LogPrintf(1, " %02x", out[i]);
+        LogPrintf(1, "\n");
+    }
+    return out;
+}
+
+char* ut_gen_string(ut_gen_t* gen, size_t max_len)
+{
+    size_t len = Draw(gen, max_len + 1);
+    char* out = ut_gen_alloc(gen, len + 1);
+    for (size_t i = 0; i < len; i++)
+        out[i] = character_set[Draw(gen, sizeof(character_set) - 1)];
+    out[len] = '\0';
+    if (gen->verbose)
+        LogPrintf(1, "  gen string: \"%s\"\n", out);
+    return out;
+}
+
+static void FreeCaseMemory(ut_gen_t* gen)
+{
+    for (size_t i = 0; i < gen->n_allocs; i++)
+        InternalFree(gen->allocs[i]);
+    gen->n_allocs = 0;
+}
+
+/* Run one case of the property, returns 1 if it failed */
+static int RunCase(void (*prop)(UTestRunner*, ut_gen_t*), UTestRunner* r, ut_gen_t* gen)
+{
+    int before = r->test->status;
+    gen->pos = 0;
+    prop(r, gen);
+    FreeCaseMemory(gen);
+    ResetArena(1);
+    gen->len = gen->pos;
+    return r->test->status > before;
+}
+
+struct utest_prop_run {
+    UTestCase* test;
+    pthread_t caller;
+    void (*prop)(UTestRunner*, ut_gen_t*);
+    uint64_t seed;
+    long cases;
+    long next;
+    long failed;      /* lowest failing case, `cases` while none failed */
+    uint64_t stop_ns; /* stop trying new cases after this time, 0 for never */
+};
+
+static uint64_t CaseSeed(struct utest_prop_run* run, long i)
+{
+    uint64_t x = run->seed ^ (uint64_t)i;
+    return SplitMix64(&x);
+}
+
+static void* PropertyLoop(void* arg)
+{
+    struct utest_prop_run* run = arg;
+    UTestCase local = *run->test;
+    UTestCase* caller_test = _current_test;
+    UTestRunner runner;
+    ut_gen_t gen;
+    long i;
+
+    memset(&gen, 0, sizeof(gen));
+    gen.random = 1;
+    RunnerInit(&runner);
+    local.status = 0;
+    runner.test = &local;
+    _current_test = &local;
+    Quiet++;
+
+    while ((i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) < run->cases
+           && i < __atomic_load_n(&run->failed, __ATOMIC_RELAXED))
+    {
+        if (run->stop_ns != 0 && MonotonicNs() > run->stop_ns)
+            break;
+        ut_rand_seed(&gen.rng, CaseSeed(run, i));
+        gen.len = 0;
+        if (RunCase(run->prop, &runner, &gen)) {
+            long seen = __atomic_load_n(&run->failed, __ATOMIC_RELAXED);
+            while (i < seen && !__atomic_compare_exchange_n(&run->failed, &seen, i, 0,
+                                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+        }
+    }
+
+    Quiet--;
+    _current_test = caller_test;
+    InternalFree(gen.choices);
+    InternalFree(gen.allocs);
+    if (!pthread_equal(pthread_self(), run->caller)) {
+        ResetArena(0);
+        FreeLogs();
+    }
+    return NULL;
+}
+
+static int PropertyThreads(void)
+{
+    long cpus;
+    if (Options.prop_threads > 0)
+        return Options.prop_threads;
+    /* the runner already keeps the cores busy */
+    if (Options.threads > 1 || Options.jobs > 1 || TestDepth > 1)
+        return 1;
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+/* Is the sequence a (of length na) smaller than b? */
+static int SmallerChoices(const uint64_t* a, size_t na, const uint64_t* b, size_t nb)
+{
+    if (na != nb)
+        return na < nb;
+    for (size_t i = 0; i < na; i++)
+        if (a[i] != b[i])
+            return a[i] < b[i];
+    return 0;
+}
+
+/*
+ * Replay `cand` and keep it as the best sequence if the property still fails
+ * with it and the choices it used are smaller than the best so far.
+ */
+static int TryShrink(struct utest_prop_run* run, UTestRunner* r, ut_gen_t* gen,
+                     uint64_t* cand, size_t n, uint64_t** best, size_t* best_len, int* tries)
+{
+    int smaller = 0;
+
+    (*tries)++;
+    gen->len = 0;
+    if (gen->cap < n + 1) {
+        gen->cap = n + 1;
+        gen->choices = InternalRealloc(gen->choices, gen->cap * sizeof(uint64_t));
+    }
+    memcpy(gen->choices, cand, n * sizeof(uint64_t));
+    gen->len = n;
+    if (RunCase(run->prop, r, gen) && SmallerChoices(gen->choices, gen->len, *best, *best_len)) {
+        memcpy(*best, gen->choices, gen->len * sizeof(uint64_t));
+        *best_len = gen->len;
+        smaller = 1;
+    }
+    r->test->status = 0;
+    return smaller;
+}
+
+/* Shrink the failing choices in `best`, returns the number of smaller cases found */
+static int Shrink(struct utest_prop_run* run, UTestRunner* r, uint64_t* best, size_t* best_len)
+{
+    uint64_t* cand = InternalMalloc((*best_len + 1) * sizeof(uint64_t));
+    ut_gen_t gen;
+    int tries = 0, shrinks = 0, improved = 1;
+
+    memset(&gen, 0, sizeof(gen));
+    while (improved && tries < PROP_SHRINK_TRIES)
+    {
+        improved = 0;
+        /* delete runs of choices, longest first */
+        for (size_t k = 8; k >= 1; k /= 2)
+        {
+            for (size_t i = *best_len; i >= k && tries < PROP_SHRINK_TRIES; i--)
+            {
+                size_t at = i - k;
+                if (at + k > *best_len)
+                    continue;
+                memcpy(cand, best, at * sizeof(uint64_t));
+                memcpy(cand + at, best + at + k, (*best_len - at - k) * sizeof(uint64_t));
+                if (TryShrink(run, r, &gen, cand, *best_len - k, &best, best_len, &tries))
+                    shrinks++, improved = 1;
+            }
+        }
+        /* delete a choice and lower an earlier one, like an element and its count */
+        for (size_t i = 0; i + 1 < *best_len && tries < PROP_SHRINK_TRIES; i++)
+        {
+            for (size_t j = i + 1; j < *best_len && best[i] > 0 && tries < PROP_SHRINK_TRIES; j++)
+            {
+                memcpy(cand, best, j * sizeof(uint64_t));
+                memcpy(cand + j, best + j + 1, (*best_len - j - 1) * sizeof(uint64_t));
+                cand[i]--;
+                if (TryShrink(run, r, &gen, cand, *best_len - 1, &best, best_len, &tries))
+                    shrinks++, improved = 1;
+            }
+        }
+        /* move the value of a choice onto a later one, so it can be deleted next */
+        for (size_t i = 0; i + 1 < *best_len && tries < PROP_SHRINK_TRIES; i++)
+        {
+            for (size_t j = i + 1; j < *best_len && best[i] > 0 && tries < PROP_SHRINK_TRIES; j++)
+            {
+                memcpy(cand, best, *best_len * sizeof(uint64_t));
+                cand[j] += cand[i];
+                cand[i] = 0;
+                if (TryShrink(run, r, &gen, cand, *best_len, &best, best_len, &tries))
+                    shrinks++, improved = 1;
+            }
+        }
+        /* lower each choice, binary searching for the smallest that still fails */
+        for (size_t i = 0; i < *best_len && tries < PROP_SHRINK_TRIES; i++)
+        {
+            uint64_t lo = 0, hi = best[i];
+            if (hi == 0)
+                continue;
+            memcpy(cand, best, *best_len * sizeof(uint64_t));
+            cand[i] = 0;
+            if (TryShrink(run, r, &gen, cand, *best_len, &best, best_len, &tries)) {
+                shrinks++, improved = 1;
+                continue;
+            }
+            while (lo + 1 < hi && i < *best_len && tries < PROP_SHRINK_TRIES) {
+                uint64_t mid = lo + (hi - lo) / 2;
+                memcpy(cand, best, *best_len * sizeof(uint64_t));
+                cand[i] = mid;
+                if (TryShrink(run, r, &gen, cand, *best_len, &best, best_len, &tries))
+                    hi = mid, shrinks++, improved = 1;
+                else
+                    lo = mid;
+            }
+        }
+    }
+    InternalFree(cand);
+    InternalFree(gen.choices);
+    InternalFree(gen.allocs);
+    return shrinks;
+}
+
+void utest_property(UTestRunner* r, void (*prop)(UTestRunner*, ut_gen_t*))
+{
+    UTestCase* test = r->test;
+    struct utest_prop_run run;
+    pthread_t* threads;
+    int nthreads = PropertyThreads();
+    int limit_ms = test->budget_ms > 0 ? test->budget_ms : Options.budget_ms;
+    int timeout_ms = TestTimeout(test);
+    uint64_t* best;
+    size_t best_len;
+    int shrinks, status;
+    ut_gen_t gen;
+
+    if (timeout_ms > 0 && (limit_ms <= 0 || timeout_ms < limit_ms))
+        limit_ms = timeout_ms;
+
+    memset(&run, 0, sizeof(run));
+    run.test = test;
+    run.caller = pthread_self();
+    run.prop = prop;
+    run.seed = RunSeed() ^ HashName(test->name);
+    run.cases = Options.cases > 0 ? Options.cases : test->cases > 0 ? test->cases : 1000;
+    run.failed = run.cases;
+    /* leave half of the time limit for shrinking */
+    if (limit_ms > 0)
+        run.stop_ns = MonotonicNs() + (uint64_t)limit_ms * 500000;
+
+    if (nthreads > run.cases)
+        nthreads = (int)run.cases;
+    threads = InternalCalloc(nthreads, sizeof(pthread_t));
+    fflush(stdout);
+    for (int t = 1; t < nthreads; t++)
+        if (pthread_create(&threads[t], NULL, PropertyLoop, &run) != 0)
+            threads[t] = 0;
+    PropertyLoop(&run);
+    for (int t = 1; t < nthreads; t++)
+        if (threads[t] != 0)
+            pthread_join(threads[t], NULL);
+    InternalFree(threads);
+
+    if (run.failed >= run.cases)
+        return;
+
+    /* record the failing case again on this thread and shrink it */
+    memset(&gen, 0, sizeof(gen));
+    gen.random = 1;
+    ut_rand_seed(&gen.rng, CaseSeed(&run, run.failed));
+    status = test->status;
+    Quiet++;
+    RunCase(prop, r, &gen);
+    best_len = gen.len;
+    best = InternalMalloc((best_len + 1) * sizeof(uint64_t));
+    memcpy(best, gen.choices, best_len * sizeof(uint64_t));
+    test->status = 0;
+    shrinks = Shrink(&run, r, best, &best_len);
+    Quiet--;
+    test->status = status;
+
+    LogPrintf(1, COL_ERROR "Property Failure:" COL_RESET
+              " TEST(%s) failed on case %ld of %ld, shrunk %d times,"
+              " rerun with UTEST_SEED=%llu\n",
+              test->name, run.failed + 1, run.cases, shrinks, (unsigned long long)RunSeed());
+
+    /* the smallest input, with its values and assertion failures shown */
+    gen.random = 0;
+    gen.verbose = 1;
+    memcpy(gen.choices, best, best_len * sizeof(uint64_t));
+    gen.len = best_len;
+    if (!RunCase(prop, r, &gen))
+        test->status += assertion_failure("TEST(%s) passed when its failing case was replayed, "
+                                          "the property isn't deterministic\n", test->name);
+    fflush(stdout);
+    InternalFree(best);
+    InternalFree(gen.choices);
+    InternalFree(gen.allocs);
+}
+
+/*
+ * Test arena
+ *
+ * A bump allocator for scratch memory that lives as long as the test that
+ * allocated it. Each thread has its own list of chunks, newest (and
+ * largest) first. After a test's teardown everything but the newest chunk
+ * is freed, and that one is kept for the next test unless it is large.
+ */
+
+#define ARENA_ALIGN      16
+#define ARENA_MIN_CHUNK  (64 * 1024)
+#define ARENA_KEEP_CHUNK (1024 * 1024)
+
+struct utest_arena_chunk {
+    struct utest_arena_chunk* next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+static __thread struct utest_arena_chunk* Arena;
+
+void* utest_alloc(size_t size)
+{
+    struct utest_arena_chunk* c = Arena;
+    size_t offset;
+
+    if (size > SIZE_MAX / 2)
+        return NULL;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (c == NULL || c->size - c->used < size)
+    {
+        size_t chunk = c != NULL ? c->size * 2 : ARENA_MIN_CHUNK;
+        while (chunk < size)
+            chunk *= 2;
+        c = InternalMalloc(sizeof(struct utest_arena_chunk) + chunk);
+        if (c == NULL)
+            return NULL;
+        c->size = chunk;
+        c->used = 0;
+        c->next = Arena;
+        Arena = c;
+    }
+    offset = c->used;
+    c->used += size;
+    return c->data + offset;
+}
+
+void* utest_calloc(size_t n, size_t size)
+{
+    void* p = utest_alloc(n * size);
+    if (p != NULL)
+        memset(p, 0, n * size);
+    return p;
+}
+
+char* utest_strdup(const char* s)
+{
+    size_t len = strlen(s) + 1;
+    char* p = utest_alloc(len);
+    if (p != NULL)
+        memcpy(p, s, len);
+    return p;
+}
+
+/* Free this thread's arena, keeping the newest chunk if `keep` is set */
+static void ResetArena(int keep)
+{
+    struct utest_arena_chunk* c = Arena;
+    if (c == NULL)
+        return;
+    if (!keep || c->size > ARENA_KEEP_CHUNK) {
+        Arena = NULL;
+    } else {
+        Arena = c;
+        c->used = 0;
+        c = c->next;
+        Arena->next = NULL;
+    }
+    while (c != NULL) {
+        struct utest_arena_chunk* next = c->next;
+        InternalFree(c);
+        c = next;
+    }
+}
+
+char** random_strings(int n_strings, int str_length)
+{
+    ut_rand_t* rng = utest_rand();
+    char** list = malloc(sizeof(char*) * n_strings);
+    int i;
+    for (i = 0; i < n_strings; i++)
+    {
+        list[i] = malloc((str_length + 1) * sizeof(char));
+        RandomChars(rng, list[i], str_length);
+        list[i][str_length] = '\0';
+    }
+    return list;
+}
+
+/*
+ * Clock
+ *
+ * Ticks are nanoseconds from CLOCK_MONOTONIC_RAW, or cycles of the time
+ * stamp counter once it has been calibrated and turned on.
+ */
+static struct {
+    int tsc;
+    double ns_per_tick;
+    double tsc_ns_per_tick;
+} Clock = { .ns_per_tick = 1.0 };
+
+static uint64_t MonotonicNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* User and system time used by the calling thread */
+static uint64_t ThreadCpuNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t ReadTsc(void)
+{
+    _mm_lfence();
+    return __rdtsc();
+}
+
+static int HasInvariantTsc(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0x80000000, NULL) < 0x80000007)
+        return 0;
+    __cpuid(0x80000007, eax, ebx, ecx, edx);
+    return (edx >> 8) & 1;
+}
+
+/* Count cycles over ~10ms of the monotonic clock */
+static double CalibrateTsc(void)
+{
+    uint64_t ns0 = MonotonicNs(), c0 = ReadTsc();
+    uint64_t ns1, c1;
+    do {
+        ns1 = MonotonicNs();
+        c1 = ReadTsc();
+    } while (ns1 - ns0 < 10000000);
+    return (double)(ns1 - ns0) / (double)(c1 - c0);
+}
+#else
+static uint64_t ReadTsc(void) { return MonotonicNs(); }
+static int HasInvariantTsc(void) { return 0; }
+static double CalibrateTsc(void) { return 1.0; }
+#endif
+
+int ut_timer_use_tsc(int on)
+{
+    if (on && !HasInvariantTsc())
+        on = 0;
+    if (on && Clock.tsc_ns_per_tick == 0)
+        Clock.tsc_ns_per_tick = CalibrateTsc();
+
+    Clock.tsc = on;
+    Clock.ns_per_tick = on ? Clock.tsc_ns_per_tick : 1.0;
+    return on;
+}
+
+uint64_t ut_clock_ticks(void)
+{
+    if (Clock.tsc)
+        return ReadTsc();
+    return MonotonicNs();
+}
+
+double ut_clock_ticks_to_ns(uint64_t ticks)
+{
+    return ticks * Clock.ns_per_tick;
+}
+
+void ut_timer_start(struct utest_timer* timer)
+{
+    timer->start = ut_clock_ticks();
+}
+
+void ut_timer_end(struct utest_timer* timer)
+{
+    timer->end = ut_clock_ticks();
+}
+
+double ut_timer_sec(struct utest_timer timer)
+{
+    return ut_clock_ticks_to_ns(timer.end - timer.start) / 1e9;
+}
+
+double ut_timer_usec(struct utest_timer timer)
+{
+    return ut_clock_ticks_to_ns(timer.end - timer.start) / 1e3;
+}
+
+uint64_t ut_timer_nsec(struct utest_timer timer)
+{
+    return (uint64_t)ut_clock_ticks_to_ns(timer.end - timer.start);
+}
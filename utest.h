@@ -5,14 +5,30 @@
 extern "C" {
 #endif
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+/* no longer used here, kept for one release for code that gets gettimeofday
+ * and struct timeval through utest.h */
 #include <sys/time.h>
 
 struct utest_runner;
 
+/**
+ * Heap usage of a test, see utest_alloc_stats.
+ */
+typedef struct utest_alloc_stats
+{
+    size_t allocs; /* calls to malloc, calloc and realloc */
+    size_t frees;  /* calls to free (and reallocs that moved a block) */
+    size_t bytes;  /* total bytes allocated */
+    long live;     /* bytes allocated and not freed yet */
+    long peak;     /* highest value of live */
+} ut_alloc_stats_t;
+
 typedef void (*TestMethod)(struct utest_runner*);
 typedef int (*AssertionMsgFunc)(const char*, ...);
 
@@ -25,11 +41,19 @@ typedef struct utest_case
     void (*teardown)(void);
     int ignore;
     int capture_output;
+    int bench;
+    int perf;      /* count cpu events in the benchmark, see --perf */
+    int cases;     /* number of inputs a PROPERTY tries, 1000 by default */
+    int budget_ms; /* fail (or warn) when the test takes longer than this */
+    int timeout_ms; /* stop waiting for the test after this long */
 
     TestMethod test;
     char* name;
     int status;
     char* output;
+    uint64_t wall_ns; /* time taken by setup, test and teardown */
+    uint64_t cpu_ns;  /* cpu time (user + system) of the same */
+    ut_alloc_stats_t alloc_stats; /* heap usage of the same */
 } UTestCase;
 
 typedef struct utest_runner
@@ -37,16 +61,40 @@ typedef struct utest_runner
     UTestCase* test;
     AssertionMsgFunc fail;
     AssertionMsgFunc warning;
+    struct utest_bench* bench; /* only set while running a benchmark */
 } UTestRunner;
 
-/* Internal global variable, DO NOT TOUCH */
-extern UTestCase *_current_test;
+/**
+ * Receives the results of a run as they come in, see utest_add_reporter.
+ *
+ * begin is called with the number of tests about to run, test once for
+ * every test (ignored ones included) in the order they are printed, with
+ * everything the test wrote to stdout and stderr, and end after the last
+ * one. Output isn't collected from tests run with --threads. Any of them
+ * can be NULL.
+ */
+typedef struct utest_reporter
+{
+    void (*begin)(struct utest_reporter* rep, int n);
+    void (*test)(struct utest_reporter* rep, UTestCase* test,
+                 const char* out, size_t out_len, const char* err, size_t err_len);
+    void (*end)(struct utest_reporter* rep, int n, int failed);
+    FILE* file;
+    void* data;
+} UTestReporter;
+
+/* Internal thread local variable, DO NOT TOUCH */
+extern __thread UTestCase *_current_test;
 
 /**
  * A timer that keeps track of the time it was started and ended.
+ *
+ * Times are in ticks of the utest clock. That is CLOCK_MONOTONIC_RAW in
+ * nanoseconds unless the cycle counter has been turned on with
+ * `ut_timer_use_tsc`, use the accessors below to convert them.
  */
 typedef struct utest_timer {
-    struct timeval start, end;
+    uint64_t start, end;
 } ut_timer_t;
 
 /**
@@ -64,6 +112,66 @@ void ut_timer_end(struct utest_timer* timer);
  */
 double ut_timer_sec(struct utest_timer timer);
 
+/**
+ * Get the number of microseconds that the timer was running
+ */
+double ut_timer_usec(struct utest_timer timer);
+
+/**
+ * Get the number of nanoseconds that the timer was running
+ */
+uint64_t ut_timer_nsec(struct utest_timer timer);
+
+/**
+ * Read the current time of the utest clock in ticks.
+ */
+uint64_t ut_clock_ticks(void);
+
+/**
+ * Convert a number of clock ticks to nanoseconds.
+ */
+double ut_clock_ticks_to_ns(uint64_t ticks);
+
+/**
+ * Use the cpu's time stamp counter (rdtsc) as the utest clock. The counter is
+ * calibrated against CLOCK_MONOTONIC_RAW the first time it is turned on.
+ *
+ * Only available on x86 cpus with an invariant time stamp counter. Returns 1
+ * when the counter is in use and 0 when the monotonic clock is being used.
+ * Timers must not be started and ended with different clocks.
+ */
+int ut_timer_use_tsc(int on);
+
+/**
+ * State of a running benchmark, available as `utest->bench` inside of a
+ * BENCH body.
+ */
+typedef struct utest_bench
+{
+    size_t n;      /* number of iterations the body should run */
+    size_t bytes;  /* bytes processed per iteration, used for throughput */
+
+    ut_timer_t timer;
+    double elapsed;
+    int running;
+} UTestBench;
+
+/**
+ * Stop the benchmark timer, use this to exclude expensive work from the
+ * measurement.
+ */
+void ut_bench_stop_timer(UTestBench* b);
+
+/**
+ * Start the benchmark timer again after a call to `ut_bench_stop_timer`.
+ */
+void ut_bench_start_timer(UTestBench* b);
+
+/**
+ * Throw away the time measured so far, useful after setup inside the body.
+ */
+void ut_bench_reset_timer(UTestBench* b);
+
 /**
  * 8 bit unsigned integer.
  */
@@ -75,6 +183,107 @@ typedef unsigned int byte_t __attribute__((__mode__(QI)));
  */
 int RunTests(void);
 
+/**
+ * Run all the tests using options from the command line. This is what the
+ * main function inserted by the AUTOTEST macro calls.
+ *
+ * Options:
+ *   --filter PATS   only run the tests whose names match one of the glob
+ *                   patterns in PATS, separated by ':' or ','. Patterns
+ *                   starting with '-' exclude tests, for example
+ *                   "parse_*:-parse_slow_*". UTEST_FILTER sets the default.
+ *   --list          print the names of the selected tests and exit.
+ *   --seed N        seed for the random data generators (see utest_rand),
+ *                   same as UTEST_SEED. Picked from the clock by default.
+ *   --shard-index=I, --total-shards=N
+ *                   only run the tests that belong to shard I (counting
+ *                   from 0) out of N, same as UTEST_SHARD_INDEX and
+ *                   UTEST_TOTAL_SHARDS. Tests are split by a hash of their
+ *                   name, or by duration when given a durations file.
+ *   --save-durations=FILE
+ *                   write the wall time of every test that ran to FILE,
+ *                   same as UTEST_SAVE_DURATIONS.
+ *   --shard-durations=FILE
+ *                   balance shards using the durations saved in FILE by an
+ *                   earlier run, same as UTEST_SHARD_DURATIONS. The files
+ *                   written by several shards can be concatenated.
+ *   -j N, --jobs N  run the tests in a pool of N forked worker processes,
+ *                   N = 0 (or no N) uses one worker per cpu. The UTEST_JOBS
+ *                   environment variable sets the default. A test that
+ *                   kills its worker fails with the signal's name and a new
+ *                   worker runs the rest of the tests.
+ *   --isolate[=N]   run the tests in forked workers even without -j (one
+ *                   worker unless -j says otherwise) and replace every
+ *                   worker after N tests, 0 (or no N) keeps a worker until
+ *                   it crashes. UTEST_ISOLATE=N sets the default.
+ *   --threads N     run the tests on N threads in this process. Tests that
+ *                   capture output are serialized against each other but
+ *                   anything printed by another thread during a capture
+ *                   ends up in it. UTEST_THREADS sets the default.
+ *   --bench         run the benchmarks instead of the tests.
+ *   --benchtime MS  target duration of each benchmark in milliseconds,
+ *                   defaults to 1000 or UTEST_BENCHTIME.
+ *   --cases=N       number of inputs every PROPERTY tries, UTEST_CASES.
+ *   --prop-threads=N
+ *                   threads a PROPERTY spreads its cases over, one per cpu
+ *                   by default (one when tests already run in parallel).
+ *                   UTEST_PROP_THREADS sets the default.
+ *   --perf          count cycles, instructions, branch misses, L1d and LLC
+ *                   misses and context switches with perf_event_open
+ *                   while benchmarks are timed and print them per
+ *                   iteration. Counters the kernel refuses are skipped.
+ *                   Same as .perf = 1 on every benchmark or UTEST_PERF=1.
+ *   --count N       time each benchmark N times and report the median and
+ *                   median absolute deviation, UTEST_BENCH_COUNT.
+ *   --save-baseline=FILE
+ *                   save the benchmark samples to FILE, UTEST_SAVE_BASELINE.
+ *   --baseline=FILE compare the benchmarks with the samples in FILE and fail
+ *                   the ones that got significantly slower (Mann-Whitney U,
+ *                   5% level) by more than the threshold, UTEST_BASELINE.
+ *                   Both baseline options default --count to 10.
+ *   --threshold=PCT slowdown in percent a benchmark may have over its
+ *                   baseline, 5 by default or UTEST_BENCH_THRESHOLD.
+ *   --timer=tsc     time with the cpu cycle counter (see ut_timer_use_tsc),
+ *                   UTEST_TIMER=tsc does the same.
+ *   --durations N   list the N slowest tests after the run, 0 lists all of
+ *                   them. UTEST_DURATIONS sets the default.
+ *   --budget-ms MS  time budget for tests that don't set .budget_ms,
+ *                   UTEST_BUDGET_MS sets the default.
+ *   --failed-first  run the tests that failed last time first, then new
+ *                   ones, then the ones that passed in an older build of
+ *                   the binary, then the ones that passed in this one.
+ *   --last-failed   only run the tests that failed last time, or every test
+ *                   if none did.
+ *   --cache=FILE    where --failed-first and --last-failed keep the results,
+ *                   .utest-cache by default or UTEST_CACHE. Setting it also
+ *                   saves the results of plain runs.
+ *   --report FORMAT:FILE[,FORMAT:FILE...]
+ *                   stream the results to FILE as they come in, FORMAT is
+ *                   junit (JUnit XML) or json (one JSON object per line)
+ *                   and a FILE of - means stdout. Same as UTEST_REPORT.
+ *   --timeout-ms MS timeout for tests that don't set .timeout_ms, same as
+ *                   UTEST_TIMEOUT_MS. Forked workers running a test past
+ *                   its timeout are killed and the test fails, otherwise
+ *                   the stuck test and its captured output are printed and
+ *                   the whole run stops.
+ *   --budget-warn   only warn when a test goes over its budget instead of
+ *                   failing it, same as UTEST_BUDGET_WARN=1.
+ */
+int RunTestsArgs(int argc, char** argv);
+
+/**
+ * Send the results of the next run to `rep` as well as the terminal.
+ * Returns -1 if there are already too many reporters.
+ */
+int utest_add_reporter(UTestReporter* rep);
+
+/**
+ * Reporters that stream JUnit XML or newline delimited JSON into `f`, one
+ * record per test flushed as soon as it is written.
+ */
+UTestReporter* utest_junit_reporter(FILE* f);
+UTestReporter* utest_json_reporter(FILE* f);
+
 /**
  * Search for string `str` in an array `arr` having length `len`.
  *
@@ -85,12 +294,150 @@ int str_arr_contains(char** arr, size_t len, char* str);
 /**
  * Create 'n_strings' random strings all having a length of 'str_length'.
  *
- * The resulting array of char pointers must be freed when done with.
+ * The strings come from the current test's generator (see utest_rand). Each
+ * string and the resulting array of char pointers must be freed when done
+ * with, ut_rand_strings makes the same strings in a single allocation.
  */
 char** random_strings(int n_strings, int str_length);
 
-// internal
+/**
+ * Heap usage of the current test since its setup started.
+ *
+ * Only counted when utest.c is compiled with -DUTEST_TRACK_ALLOCS and the
+ * test binary is linked with
+ *   -Wl,--wrap=malloc,--wrap=free,--wrap=calloc,--wrap=realloc
+ * Only calls made from code linked that way are seen, memory allocated
+ * inside of libc (strdup, fopen, ...) is not. Warns once if tracking is off.
+ */
+ut_alloc_stats_t utest_alloc_stats(void);
+
+/**
+ * Returns 1 when allocation tracking is compiled in.
+ */
+int utest_alloc_tracking(void);
+
+/**
+ * Allocate `size` bytes of scratch memory for the current test.
+ *
+ * The memory comes from a per-thread arena that is reset in bulk after the
+ * test's teardown, so it must not be freed and must not be used after the
+ * test is over. Allocations are aligned to 16 bytes.
+ */
+void* utest_alloc(size_t size);
+
+/**
+ * Same as `utest_alloc` but the memory is zeroed.
+ */
+void* utest_calloc(size_t n, size_t size);
+
+/**
+ * Copy a string into memory from `utest_alloc`.
+ */
+char* utest_strdup(const char* s);
+
+/**
+ * Same as `ut_rand_strings` with the current test's generator and memory
+ * from `utest_alloc`, so nothing needs to be freed.
+ */
+char** utest_random_strings(size_t n, size_t len);
+
+/**
+ * A seedable pseudo random number generator (xoshiro256**).
+ */
+typedef struct utest_rand {
+    uint64_t s[4];
+    uint64_t seed;
+} ut_rand_t;
+
+/**
+ * The random number generator of the current test.
+ *
+ * It is seeded from the seed of the run and the name of the test, so a test
+ * gets the same data however the tests are scheduled. When a test that used
+ * it fails the runner prints the seed, which can be replayed with
+ * UTEST_SEED=<seed> or --seed <seed>.
+ */
+ut_rand_t* utest_rand(void);
+
+/**
+ * Seed a generator, the same seed always gives the same sequence.
+ */
+void ut_rand_seed(ut_rand_t* rng, uint64_t seed);
+
+/**
+ * Get the next 64 random bits.
+ */
+uint64_t ut_rand_next(ut_rand_t* rng);
+
+/**
+ * Get a uniformly distributed number in [0, n).
+ */
+uint64_t ut_rand_below(ut_rand_t* rng, uint64_t n);
+
+/**
+ * Fill `len` bytes of `buf` with random data.
+ */
+void ut_rand_bytes(ut_rand_t* rng, void* buf, size_t len);
+
+/**
+ * Fill `out` with `n` integers uniformly distributed in [min, max]. Fails
+ * the current test and leaves `out` alone when min > max.
+ */
+void ut_rand_ints(ut_rand_t* rng, int* out, size_t n, int min, int max);
+
+/**
+ * Create `n` random strings of length `len` in one allocation, free the
+ * returned array to free all of the strings. Returns NULL when the memory
+ * can't be allocated.
+ */
+char** ut_rand_strings(ut_rand_t* rng, size_t n, size_t len);
+
+/**
+ * The generator of a PROPERTY case, see the ut_gen_* functions.
+ */
+typedef struct utest_gen ut_gen_t;
+
+/**
+ * Draw values for a PROPERTY case. Every generator shrinks towards its
+ * first value: 0, min, false, and empty arrays and strings. Memory from
+ * the generators is freed after each case. Ranges are inclusive, any
+ * range of int64_t works and one with min > max fails the test.
+ */
+uint64_t ut_gen_below(ut_gen_t* gen, uint64_t n);
+int64_t ut_gen_int(ut_gen_t* gen, int64_t min, int64_t max);
+int ut_gen_bool(ut_gen_t* gen);
+double ut_gen_double(ut_gen_t* gen, double min, double max);
+
+/**
+ * Generate up to `max_n` ints in [min, max] or up to `max_len` bytes, the
+ * number generated is stored in `n` or `len`.
+ */
+int* ut_gen_ints(ut_gen_t* gen, size_t* n, size_t max_n, int min, int max);
+void* ut_gen_bytes(ut_gen_t* gen, size_t* len, size_t max_len);
+
+/**
+ * Generate a string of up to `max_len` characters from the same character
+ * set as random_strings.
+ */
+char* ut_gen_string(ut_gen_t* gen, size_t max_len);
+
+/**
+ * Allocate memory that is freed when the current case ends.
+ */
+void* ut_gen_alloc(ut_gen_t* gen, size_t size);
+
+/**
+ * Run the property `prop` on generated inputs, used by the PROPERTY macro.
+ */
+void utest_property(UTestRunner* r, void (*prop)(UTestRunner*, ut_gen_t*));
+
+/**
+ * Register a test at runtime. Tests defined with the TEST macro are
+ * registered at link time and don't go through this function.
+ */
 void utest_build_testcase(UTestCase, TestMethod, char *);
+
+// internal
 int assertion_failure(const char* fmt, ...);
 int utest_warning(const char* fmt, ...);
 
@@ -104,11 +451,60 @@ int utest_warning(const char* fmt, ...);
  *       printf("all output in this block will be stored in the buffer");
  *   }
  *
- * This function relies on static variables and should only be run inside
- * a single thread at any given time.
+ * The output goes to an in-memory file, so there is no limit on how much
+ * can be captured, and `buf` is that file mapped into memory. `len` counts a
+ * terminating null byte. The buffer belongs to the current test and is
+ * unmapped when the test finishes, use `utest_capture_free` to release it
+ * sooner or when capturing outside of a test.
+ *
+ * This function relies on thread local static variables, when tests run on
+ * multiple threads it holds a lock from the start of a capture until its end.
  */
 int utest_capture_output(char **buf, size_t*);
 
+/**
+ * Release a buffer returned by any of the capture functions or macros.
+ */
+void utest_capture_free(char* buf);
+
+/**
+ * A capture of everything written to one file descriptor.
+ */
+typedef struct utest_capture
+{
+    int fd;        /* file descriptor being captured */
+    char* buf;     /* the output once the capture has ended */
+    size_t len;    /* length of buf including a terminating null byte */
+
+    int active;
+    int saved_fd;
+    int file_fd;
+    struct utest_capture* next;
+} ut_capture_t;
+
+/**
+ * Start sending everything written to `fd` into the capture `cap`.
+ *
+ * Captures of different descriptors can run at the same time and captures
+ * of the same descriptor can be nested, the inner capture gets the output
+ * written while it is running. Returns 0 on success and -1 on failure.
+ */
+int utest_capture_begin(ut_capture_t* cap, int fd);
+
+/**
+ * Stop a capture and restore its file descriptor. The output is in
+ * `cap->buf` and has the same lifetime as the buffer from
+ * `utest_capture_output`. Nested captures of the same descriptor must end
+ * innermost first. Returns 0 on success and -1 on failure.
+ */
+int utest_capture_end(ut_capture_t* cap);
+
+/**
+ * Same as `utest_capture_output` but for any file descriptor, `cap` must be
+ * zeroed before the first call.
+ */
+int utest_capture_fd(ut_capture_t* cap, int fd, char** buf, size_t* len);
+
 /**
  * Compare two byte buffers of length `len`
  *
@@ -116,6 +512,18 @@ int utest_capture_output(char **buf, size_t*);
  */
 int binary_compare(byte_t* left, byte_t* right, size_t len);
 
+/**
+ * Find the first byte that differs between two buffers of length `len`
+ * using SSE2 or AVX2 when the cpu has them.
+ *
+ * Returns the offset of that byte, or `len` if the buffers are equal.
+ */
+size_t binary_mismatch(const void* left, const void* right, size_t len);
+
+/* internal, reports an assert_eqn failure with a hex dump around `offset` */
+int utest_eqn_failure(const char* file, int line, const char* expr,
+                      const void* left, const void* right, size_t len, size_t offset);
+
 // internal utilities
 /**
  * Test to see that two arrays of character pointers are identicle.
@@ -125,36 +533,137 @@ int binary_compare(byte_t* left, byte_t* right, size_t len);
  */
 int arr_eq_s(char** arr1, char** arr2, size_t len);
 
-/* internal */
+/**
+ * Compare two strings, either of which may be NULL.
+ *
+ * Returns 0 when they are equal and 1 otherwise.
+ */
 int strcomp(char* one, char* two);
 
+/* internal, the kinds of values assert_eq knows how to compare and print */
+enum utest_kind {
+    UT_KIND_INT,
+    UT_KIND_UINT,
+    UT_KIND_PTR,
+    UT_KIND_STR,
+    UT_KIND_FLOAT,
+    UT_KIND_DOUBLE,
+    UT_KIND_LDOUBLE,
+};
+
+/*
+ * internal, compares two values of a kind that == can't decide on its own:
+ * strings by content and floating point values by how many units in the
+ * last place (ulps) lie between them.
+ */
+int utest_value_eq(const void* left, const void* right, int kind, int max_ulps);
+
+/* internal, reports an assert_eq or assert_not_eq failure with both values */
+int utest_eq_failure(const char* file, int line, const char* expr,
+                     int kind, size_t size, const void* left, const void* right);
+
 #if defined(AUTOTEST) && !defined(_MAIN_DEFINED) && !defined(_UTEST_IMPL)
 #define _MAIN_DEFINED
-int main(void) {
-    return RunTests();
+int main(int argc, char** argv) {
+    return RunTestsArgs(argc, argv);
 }
 #endif /* AUTOTEST && !_MAIN_DEFINED && !_UTEST_IMPL */
 
-#define _UTEST_PRINT_FMT(A)\
-    (_Generic((A),         \
-        char*: "%s",       \
-        const char*: "%s", \
-        int: "%d"))
+#ifndef __cplusplus
+/*
+ * The kind of a value, size_t and the other typedefs fall into the integer
+ * type they are defined as. Pointers to anything but char are compared as
+ * addresses.
+ */
+#if CHAR_MIN < 0
+#define _UTEST_CHAR_KIND UT_KIND_INT
+#else
+#define _UTEST_CHAR_KIND UT_KIND_UINT /* plain char is unsigned on this target */
+#endif
+#define _UTEST_KIND(X)                      \
+    (_Generic((X),                          \
+        char:               _UTEST_CHAR_KIND,  \
+        signed char:        UT_KIND_INT,    \
+        short:              UT_KIND_INT,    \
+        int:                UT_KIND_INT,    \
+        long:               UT_KIND_INT,    \
+        long long:          UT_KIND_INT,    \
+        _Bool:              UT_KIND_UINT,   \
+        unsigned char:      UT_KIND_UINT,   \
+        unsigned short:     UT_KIND_UINT,   \
+        unsigned int:       UT_KIND_UINT,   \
+        unsigned long:      UT_KIND_UINT,   \
+        unsigned long long: UT_KIND_UINT,   \
+        char*:              UT_KIND_STR,    \
+        const char*:        UT_KIND_STR,    \
+        float:              UT_KIND_FLOAT,  \
+        double:             UT_KIND_DOUBLE, \
+        long double:        UT_KIND_LDOUBLE,\
+        default:            UT_KIND_PTR))
+#endif /* __cplusplus */
+
+#ifndef UTEST_MAX_ULPS
+/* floats and doubles this many ulps apart or closer are equal in assert_eq */
+#define UTEST_MAX_ULPS 4
+#endif
 
 #define _ARR_EQ_DECL(SUFFIX, TYPE)                   \
 int arr_unordered_eq_##SUFFIX(TYPE*, TYPE*, size_t); \
 int arr_eq_##SUFFIX(TYPE*, TYPE*, size_t);
 
+/*
+ * arr_unordered_eq_* returns 1 when two arrays of length `len` hold the same
+ * elements the same number of times in any order, in O(len) time. The
+ * integer versions compare the bytes of each element, the float and double
+ * versions compare like ==, so -0 equals 0 and a NaN equals nothing.
+ * arr_eq_* compares the arrays element by element.
+ */
 _ARR_EQ_DECL(s, char*)
+_ARR_EQ_DECL(c, char)
+_ARR_EQ_DECL(i, int)
+_ARR_EQ_DECL(u, unsigned int)
+_ARR_EQ_DECL(l, long)
+_ARR_EQ_DECL(ul, unsigned long)
+_ARR_EQ_DECL(f, float)
+_ARR_EQ_DECL(d, double)
 
 #undef _ARR_EQ_DECL
 
-#define _EQ_EXPR(A, B)                                                           \
-(_Generic((A),                                                                   \
-    char*:       strcomp(((char*)(uintptr_t)(A)), ((char*)(uintptr_t)(B))) == 0, \
-    const char*: strcomp(((char*)(uintptr_t)(A)), ((char*)(uintptr_t)(B))) == 0, \
-    default: A == B)                                                             \
-)
+/**
+ * Unordered comparison of two arrays of `len` elements that are `size`
+ * bytes each, or of strings when `size` is 0.
+ */
+int arr_unordered_eq_n(const void* a1, const void* a2, size_t len, size_t size);
+
+/* internal, reports the elements that differ between two unordered arrays */
+int utest_unordered_failure(const char* file, int line, const char* a_expr, const char* b_expr,
+                            const void* a1, const void* a2, size_t len, size_t size);
+
+#ifndef __cplusplus
+#define _UNORDERED_SIZE(A)        \
+    (_Generic((A)[0],             \
+        char*: (size_t)0,         \
+        const char*: (size_t)0,   \
+        default: sizeof((A)[0])))
+#endif /* __cplusplus */
+
+#ifndef __cplusplus
+/*
+ * A and B must be variables of the same type. Integers and pointers take a
+ * single compare, the kind is a constant so the rest folds away. Strings
+ * and floating point values only call out when == says they differ.
+ */
+#define _EQ_EXPR(A, B)                                                  \
+    ((A) == (B) || (_UTEST_KIND(A) >= UT_KIND_STR &&                    \
+                    utest_value_eq(&(A), &(B), _UTEST_KIND(A), UTEST_MAX_ULPS)))
+
+/* declares _A and _B holding A and B converted to their common type */
+#define _EQ_VARS(A, B) __typeof__(1 ? (A) : (B)) _A = (A), _B = (B)
+#endif /* __cplusplus */
+
+#define _EQ_FAIL(A, OP, B)                                              \
+    (void)(_current_test->status += utest_eq_failure(__FILE__, __LINE__, \
+        #A OP #B, _UTEST_KIND(_A), sizeof(_A), &_A, &_B))
 
 /**
  * Causes the current test to fail giving `EXP` as an error message
@@ -179,36 +688,56 @@ _ARR_EQ_DECL(s, char*)
 /**
  * Assert that `exp` is true and fail the current test otherwise
  */
-#define assert(exp) (exp) ? ((void)0) : FAIL(#exp)
+#define assert(exp) (exp) ? ((void)0) : (void)FAIL(#exp)
 #endif
 
+#ifndef __cplusplus
 /**
- * Fail the current test if A is not equal to B
+ * Fail the current test if A is not equal to B. A and B are evaluated once
+ * and compared in their common type. Strings (char pointers and arrays) are
+ * compared by content, floats and doubles are equal when they are at most
+ * UTEST_MAX_ULPS units in the last place apart and long doubles when they
+ * are that many epsilons apart relative to the larger one. NaN is never
+ * equal to anything. A failure prints both values.
  */
-#define assert_eq(A, B)               \
-    ({__typeof__(A) _A = A;           \
-    __typeof__(B) _B = B;             \
-    (_EQ_EXPR(_A, _B)) ?              \
-        ((void)0) :                   \
-        _ASSERT_FAIL(A, " == ", B);})
+#define assert_eq(A, B)                 \
+    ({_EQ_VARS(A, B);                   \
+    (_EQ_EXPR(_A, _B)) ?                \
+        ((void)0) :                     \
+        _EQ_FAIL(A, " == ", B);})
 
 /**
- * Fail the current test if A is equal to B
+ * Fail the current test if A is equal to B, in the sense of assert_eq
+ */
+#define assert_not_eq(A, B)             \
+    ({_EQ_VARS(A, B);                   \
+    (!_EQ_EXPR(_A, _B)) ?               \
+        ((void)0) :                     \
+        _EQ_FAIL(A, " != ", B);})
+#endif /* __cplusplus */
+
+/**
+ * Fail the current test if A and B differ by more than EPS
  */
-#define assert_not_eq(A, B)  \
-    ({__typeof__(A) _A = A;  \
-    __typeof__(B) _B   = B;  \
-    (!_EQ_EXPR(_A, _B)) ?    \
-        ((void)0) :          \
-        _ASSERT_FAIL(A, " != ", B);})
+#define assert_near(A, B, EPS)                                          \
+    ({long double _A = (A), _B = (B), _E = (EPS);                       \
+    (_A - _B <= _E && _B - _A <= _E) ?                                  \
+        ((void)0) :                                                     \
+        _EQ_FAIL(A, " ~= ", B);})
 
 /**
- * Assert that the memory stored at two address for length `LEN` are equal
+ * Assert that the memory stored at two address for length `LEN` are equal.
+ * A failure shows a hex dump of both buffers around the first difference.
  */
-#define assert_eqn(A, B, LEN)     \
-    (binary_compare((byte_t*)(uintptr_t)A, (byte_t*)(uintptr_t)B, LEN)) ? \
-        ((void)0) :               \
-        _ASSERT_FAIL(A, " == ", B)
+#define assert_eqn(A, B, LEN)                                           \
+    ({const void* _L = (const void*)(uintptr_t)(A);                     \
+    const void* _R = (const void*)(uintptr_t)(B);                       \
+    size_t _N = (LEN);                                                  \
+    size_t _OFF = binary_mismatch(_L, _R, _N);                          \
+    (_OFF == _N) ?                                                      \
+        ((void)0) :                                                     \
+        (void)(_current_test->status += utest_eqn_failure(              \
+            __FILE__, __LINE__, #A " == " #B, _L, _R, _N, _OFF));})
 
 /**
  * Assert that the memory stored at two address for length `LEN` are not equal
@@ -216,16 +745,72 @@ _ARR_EQ_DECL(s, char*)
 #define assert_not_eqn(A, B, LEN)                                          \
     (!binary_compare((byte_t*)(uintptr_t)A, (byte_t*)(uintptr_t)B, LEN)) ? \
         ((void)0) :                                                        \
-        _ASSERT_FAIL(A, " != ", B)
+        (void)_ASSERT_FAIL(A, " != ", B)
+
+/**
+ * Assert that the arrays A and B of length LEN hold the same elements in any
+ * order, counting duplicates. Arrays of strings are compared with strcmp and
+ * anything else byte for byte, floats included (use arr_unordered_eq_f or
+ * arr_unordered_eq_d to compare those by value). A failure lists the elements
+ * that are only in one of the arrays.
+ */
+#define assert_unordered_eq(A, B, LEN)                                  \
+    ({const void* _L = (A);                                             \
+    const void* _R = (B);                                               \
+    size_t _N = (LEN);                                                  \
+    size_t _S = _UNORDERED_SIZE(A);                                     \
+    arr_unordered_eq_n(_L, _R, _N, _S) ?                                \
+        ((void)0) :                                                     \
+        (void)(_current_test->status += utest_unordered_failure(        \
+            __FILE__, __LINE__, #A, #B, _L, _R, _N, _S));})
+
+/**
+ * Fail the test if it has made more than N heap allocations so far.
+ */
+#define assert_allocs_le(N)                                                \
+    ({size_t _ALLOCS = utest_alloc_stats().allocs;                         \
+    (_ALLOCS <= (size_t)(N)) ?                                             \
+        ((void)0) :                                                        \
+        (void)FAILF("made %zu allocations, expected at most %zu\n",        \
+                    _ALLOCS, (size_t)(N));})
+
+/**
+ * Fail the test if it has more than N bytes allocated right now.
+ */
+#define assert_live_bytes_le(N)                                            \
+    ({long _LIVE = utest_alloc_stats().live;                               \
+    (_LIVE <= (long)(N)) ?                                                 \
+        ((void)0) :                                                        \
+        (void)FAILF("has %ld bytes allocated, expected at most %ld\n",     \
+                    _LIVE, (long)(N));})
 
 #define eq(A, B)         assert_eq(A, B)
+#ifndef __cplusplus
+/* not_eq is an operator in C++ */
 #define not_eq(A, B)     assert_not_eq(A, B)
+#endif
 #define eqn(A, B, L)     assert_eqn(A, B, L)
 #define not_eqn(A, B, L) assert_not_eqn(A, B, L)
 
 #define TEST_NAME(NAME) _utest_test_##NAME
 #define _TEST_DECL(NAME) void TEST_NAME(NAME)(UTestRunner* utest __attribute__((unused)))
 
+/*
+ * Attributes of the pointers TEST puts into the utest_cases section. `used`
+ * keeps the compiler from dropping them and `retain` keeps the linker from
+ * collecting the section with -Wl,--gc-sections. Without `retain` (gcc 10 and
+ * older, or an assembler without SHF_GNU_RETAIN) a linker script with
+ * KEEP(*(utest_cases)) does the same.
+ */
+#if defined(__has_attribute)
+#if __has_attribute(retain)
+#define _UTEST_SECTION __attribute__((used, retain, section("utest_cases")))
+#endif
+#endif
+#ifndef _UTEST_SECTION
+#define _UTEST_SECTION __attribute__((used, section("utest_cases")))
+#endif
+
 /**
  * The TEST macro is what creates a test.
  *
@@ -234,6 +819,9 @@ _ARR_EQ_DECL(s, char*)
  *   .ignore: if this is not zero, then the test will not be run
  *   .setup: a function pointer that runs before the test
  *   .teardown: a function pointer that runs after the test is complete
+ *   .budget_ms: fail the test if it takes longer than this many milliseconds
+ *   .timeout_ms: give up on the test if it is still running after this many
+ *                milliseconds, see --timeout-ms
  *
  * Example:
  *  TEST(my_test) {
@@ -243,18 +831,84 @@ _ARR_EQ_DECL(s, char*)
  *  TEST(ignored_test, .ignore = 1) {
  *      assert(false);
  *  }
+ *
+ * In C++ the options must be given in the order of UTestCase's fields.
  */
-#define TEST(NAME, ...)                                    \
-    _TEST_DECL(NAME);                                      \
-    __attribute__((constructor))                           \
-    void _add_##NAME##_to_tests(void) {                    \
-        UTestCase opt = { __VA_ARGS__ };                   \
-        utest_build_testcase(opt, TEST_NAME(NAME), #NAME); \
-    }                                                      \
+#ifndef __cplusplus
+#define TEST(NAME, ...)                                                    \
+    _TEST_DECL(NAME);                                                      \
+    static UTestCase _utest_case_##NAME = {                                \
+        .test = TEST_NAME(NAME), .name = #NAME, __VA_ARGS__                \
+    };                                                                     \
+    static UTestCase* _utest_entry_##NAME                                  \
+        _UTEST_SECTION = &_utest_case_##NAME;                              \
     _TEST_DECL(NAME)
+#else
+#define TEST(NAME, ...) _UTEST_CXX_CASE(NAME, 0, __VA_ARGS__)
+#endif /* __cplusplus */
 
 #define UTEST_OPT_IGNORE .ignore = 1
 
+/**
+ * The PROPERTY macro creates a test whose body is run on many generated
+ * inputs. The body draws its input from `gen` with the ut_gen_* functions
+ * and checks it with the usual assertions. It takes the same options as
+ * TEST, `.cases` sets the number of inputs (1000 by default, --cases=N or
+ * UTEST_CASES overrides it).
+ *
+ * Cases run on one thread per cpu unless the runner is already running
+ * tests in parallel, so the body must be thread safe, or run with
+ * --prop-threads=1 (UTEST_PROP_THREADS). When a case fails its input is
+ * shrunk to a small one that still fails, which is printed along with the
+ * seed that reproduces it. The body must only depend on what it draws from
+ * `gen`, and must not use utest->fail since that aborts. When the test has
+ * a budget or timeout, new cases stop after half of it.
+ *
+ * Example:
+ *  PROPERTY(reverse_twice, .cases = 5000) {
+ *      size_t n;
+ *      int* a = ut_gen_ints(gen, &n, 100, -1000, 1000);
+ *      int* b = ut_gen_alloc(gen, n * sizeof(int));
+ *      reverse(b, a, n); reverse(b, b, n);
+ *      assert_eqn(a, b, n * sizeof(int));
+ *  }
+ */
+#define PROPERTY(NAME, ...)                                                \
+    static void _utest_prop_##NAME(UTestRunner* utest, ut_gen_t* gen);    \
+    TEST(NAME, __VA_ARGS__) {                                              \
+        utest_property(utest, _utest_prop_##NAME);                         \
+    }                                                                      \
+    static void _utest_prop_##NAME(UTestRunner* utest __attribute__((unused)), \
+                                   ut_gen_t* gen)
+
+/**
+ * The BENCH macro creates a benchmark. It takes the same options as TEST.
+ *
+ * The body must run the code being measured `utest->bench->n` times. The
+ * runner keeps raising `n` until the body takes about as long as the
+ * target duration and then reports the time per iteration. Benchmarks only
+ * run when the runner is given the --bench flag.
+ *
+ * Example:
+ *  BENCH(bench_memcpy) {
+ *      char src[4096], dst[4096];
+ *      utest->bench->bytes = sizeof(src);
+ *      for (size_t i = 0; i < utest->bench->n; i++)
+ *          memcpy(dst, src, sizeof(src));
+ *  }
+ */
+#ifndef __cplusplus
+#define BENCH(NAME, ...) TEST(NAME, .bench = 1, __VA_ARGS__)
+#else
+#define BENCH(NAME, ...) _UTEST_CXX_CASE(NAME, 1, __VA_ARGS__)
+#endif /* __cplusplus */
+
+#ifndef __cplusplus
+#define _UTEST_ZEROED { .active = 0 }
+#else
+#define _UTEST_ZEROED {}
+#endif
+
 /**
  * Capture the output of a block of code.
  *
@@ -264,21 +918,266 @@ _ARR_EQ_DECL(s, char*)
  *       printf("hello there\n");
  *   }
  *   printf("%s", buf); // hello there\n
+ *
+ * The buffer stays valid until the end of the test.
+ */
+#define CATCH_OUTPUT(BUFFER) CATCH_FD(1, BUFFER)
+
+/**
+ * Capture everything written to stderr by a block of code, works the same
+ * way as CATCH_OUTPUT.
  */
-#define CATCH_OUTPUT(BUFFER)             \
-    char *BUFFER = NULL;                 \
-    size_t BUFFER##_length;              \
-    _current_test->capture_output = 1;   \
-    if (_current_test->output != NULL) { \
-        free(_current_test->output);     \
-        _current_test->output = NULL;    \
-    }                                    \
-    while (utest_capture_output(&BUFFER, &BUFFER##_length))
+#define CATCH_STDERR(BUFFER) CATCH_FD(2, BUFFER)
+
+/**
+ * Capture everything written to the file descriptor `FD` by a block of code.
+ * Captures can be nested and can capture different descriptors at once.
+ *
+ * Example:
+ *   CATCH_OUTPUT(out) {
+ *       CATCH_STDERR(err) {
+ *           printf("to stdout");
+ *           fprintf(stderr, "to stderr");
+ *       }
+ *   }
+ */
+#define CATCH_FD(FD, BUFFER)                                             \
+    char *BUFFER = NULL;                                                 \
+    size_t BUFFER##_length = 0;                                          \
+    _current_test->capture_output = 1;                                   \
+    for (ut_capture_t BUFFER##_capture = _UTEST_ZEROED;                  \
+         utest_capture_fd(&BUFFER##_capture, FD, &BUFFER, &BUFFER##_length);)
 
 #define CURRENT_TEST_NAME (_current_test->name)
 
 #ifdef __cplusplus
 }
-#endif
+
+/*
+ * C++
+ *
+ * The same runner and macros work from C++. What C does with _Generic is
+ * done with templates resolved at compile time: assert_eq converts both
+ * sides to their std::common_type and compares them with ==, scalars and
+ * strings exactly like in C and anything else with its own operator==. A
+ * passing assertion is inlined down to that compare, the failure path is
+ * kept out of line. Values of class types are printed with operator<< when
+ * they have one, or by a specialization of utest::printer.
+ *
+ * TEST cases are still found through the linker section, their fields are
+ * filled in by static initializers before main. TYPED_TEST registers one
+ * test per type of a utest::types list at runtime, named NAME<type>.
+ */
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace utest {
+
+/* The UT_KIND_* of a type, -1 for types only == knows how to compare */
+template <typename T>
+struct kind_of {
+    static const int value =
+        std::is_same<T, float>::value ? UT_KIND_FLOAT :
+        std::is_same<T, double>::value ? UT_KIND_DOUBLE :
+        std::is_same<T, long double>::value ? UT_KIND_LDOUBLE :
+        std::is_integral<T>::value || std::is_enum<T>::value ?
+            (std::is_signed<T>::value || std::is_enum<T>::value ? UT_KIND_INT : UT_KIND_UINT) :
+        std::is_pointer<T>::value || std::is_same<T, decltype(nullptr)>::value ? UT_KIND_PTR : -1;
+};
+template <> struct kind_of<char*> { static const int value = UT_KIND_STR; };
+template <> struct kind_of<const char*> { static const int value = UT_KIND_STR; };
+
+/**
+ * Turns a value into the text shown when an assertion fails. Specialize it
+ * for types that have no operator<<.
+ */
+template <typename T, typename = void>
+struct printer {
+    static std::string print(const T&)
+    {
+        return "<" + std::to_string(sizeof(T)) + " byte object>";
+    }
+};
+
+template <typename T>
+struct printer<T, decltype(void(std::declval<std::ostream&>() << std::declval<const T&>()))> {
+    static std::string print(const T& value)
+    {
+        std::ostringstream out;
+        out << value;
+        return out.str();
+    }
+};
+
+template <typename A, typename B>
+struct common {
+    typedef typename std::common_type<typename std::decay<A>::type,
+                                      typename std::decay<B>::type>::type type;
+};
+
+template <typename T>
+inline bool equal(const T& a, const T& b, std::true_type /* scalar */)
+{
+    return a == b || (kind_of<T>::value >= UT_KIND_STR &&
+                      utest_value_eq(&a, &b, kind_of<T>::value, UTEST_MAX_ULPS));
+}
+
+template <typename T>
+inline bool equal(const T& a, const T& b, std::false_type)
+{
+    return a == b;
+}
+
+template <typename T>
+__attribute__((noinline, cold))
+int eq_failure(const char* file, int line, const char* expr, const T& a, const T& b,
+               std::true_type /* scalar */)
+{
+    return utest_eq_failure(file, line, expr, kind_of<T>::value, sizeof(T), &a, &b);
+}
+
+template <typename T>
+__attribute__((noinline, cold))
+int eq_failure(const char* file, int line, const char* expr, const T& a, const T& b,
+               std::false_type)
+{
+    std::string l = printer<T>::print(a), r = printer<T>::print(b);
+    const char* lp = l.c_str();
+    const char* rp = r.c_str();
+    return utest_eq_failure(file, line, expr, UT_KIND_STR, sizeof(lp), &lp, &rp);
+}
+
+template <typename A, typename B>
+inline void check_eq(bool expect, const A& a, const B& b,
+                     const char* file, int line, const char* expr)
+{
+    typedef typename common<const A, const B>::type T;
+    typedef std::integral_constant<bool, kind_of<T>::value >= 0> scalar;
+    const T& l = a;
+    const T& r = b;
+    if (__builtin_expect(equal(l, r, scalar()) != expect, 0))
+        _current_test->status += eq_failure(file, line, expr, l, r, scalar());
+}
+
+/* Element size given to arr_unordered_eq_n, 0 for strings */
+template <typename T> struct elem_size { static const size_t value = sizeof(T); };
+template <> struct elem_size<char*> { static const size_t value = 0; };
+template <> struct elem_size<const char*> { static const size_t value = 0; };
+
+inline UTestCase make_case(UTestCase opt, TestMethod test, const char* name, int bench)
+{
+    opt.test = test;
+    opt.name = const_cast<char*>(name);
+    opt.bench |= bench;
+    return opt;
+}
+
+/* The name the compiler gives T, without spaces so it fits in result files */
+template <typename T>
+const char* type_name()
+{
+    static std::string name;
+    if (name.empty()) {
+        std::string f = __PRETTY_FUNCTION__;
+        size_t at = f.find("T = ") + 4;
+        size_t end = f.find_first_of(";]", at);
+        for (size_t i = at; i < end && i < f.size(); i++)
+            if (f[i] != ' ')
+                name += f[i];
+    }
+    return name.c_str();
+}
+
+/**
+ * A list of types for TYPED_TEST.
+ */
+template <typename... Ts>
+struct types {};
+
+template <template <typename> class Test, typename List>
+struct typed_tests;
+
+template <template <typename> class Test, typename... Ts>
+struct typed_tests<Test, types<Ts...> > {
+    static int add(const char* name, UTestCase opt)
+    {
+        int added[] = { 0, (add_one(name, type_name<Ts>(), &Test<Ts>::run, opt), 1)... };
+        return (int)(sizeof(added) / sizeof(added[0])) - 1;
+    }
+
+    static void add_one(const char* name, const char* type, TestMethod run, UTestCase opt)
+    {
+        std::string full = std::string(name) + "<" + type + ">";
+        utest_build_testcase(opt, run, strdup(full.c_str()));
+    }
+};
+
+} /* namespace utest */
+
+#undef _UTEST_KIND
+#define _UTEST_KIND(X) (utest::kind_of<typename std::decay<decltype(X)>::type>::value)
+
+#define _UNORDERED_SIZE(A) \
+    (utest::elem_size<typename std::decay<decltype((A)[0])>::type>::value)
+
+/**
+ * Fail the current test if A is not equal to B, see the C version above.
+ * Types other than numbers, pointers and strings are compared with their
+ * operator==.
+ */
+#define assert_eq(A, B) \
+    utest::check_eq(true, (A), (B), __FILE__, __LINE__, #A " == " #B)
+
+/**
+ * Fail the current test if A is equal to B
+ */
+#define assert_not_eq(A, B) \
+    utest::check_eq(false, (A), (B), __FILE__, __LINE__, #A " != " #B)
+
+/* options leave most fields of UTestCase out on purpose */
+#define _UTEST_OPTS_BEGIN                                                  \
+    _Pragma("GCC diagnostic push")                                         \
+    _Pragma("GCC diagnostic ignored \"-Wmissing-field-initializers\"")
+#define _UTEST_OPTS_END _Pragma("GCC diagnostic pop")
+
+#define _UTEST_CXX_CASE(NAME, BENCH, ...)                                  \
+    _TEST_DECL(NAME);                                                      \
+    _UTEST_OPTS_BEGIN                                                      \
+    static UTestCase _utest_case_##NAME =                                  \
+        utest::make_case(UTestCase{ __VA_ARGS__ }, TEST_NAME(NAME), #NAME, BENCH); \
+    _UTEST_OPTS_END                                                        \
+    static UTestCase* _utest_entry_##NAME                                  \
+        _UTEST_SECTION = &_utest_case_##NAME;                              \
+    _TEST_DECL(NAME)
+
+/**
+ * The TYPED_TEST macro creates one test for every type in TYPES, which
+ * must name a utest::types<...> (use a typedef, the macro can't take the
+ * commas). The body sees the type as TypeParam. Takes the same options as
+ * TEST.
+ *
+ * Example:
+ *  typedef utest::types<std::vector<int>, std::deque<int> > Sequences;
+ *  TYPED_TEST(push_back, Sequences) {
+ *      TypeParam seq;
+ *      seq.push_back(1);
+ *      eq(seq.size(), 1);
+ *  }
+ */
+#define TYPED_TEST(NAME, TYPES, ...)                                       \
+    template <typename TypeParam>                                          \
+    struct _utest_typed_##NAME {                                           \
+        static void run(UTestRunner* utest);                               \
+    };                                                                     \
+    _UTEST_OPTS_BEGIN                                                      \
+    static int _utest_typed_count_##NAME __attribute__((unused)) =         \
+        utest::typed_tests<_utest_typed_##NAME, TYPES>::add(               \
+            #NAME, UTestCase{ __VA_ARGS__ });                              \
+    _UTEST_OPTS_END                                                        \
+    template <typename TypeParam>                                          \
+    void _utest_typed_##NAME<TypeParam>::run(UTestRunner* utest __attribute__((unused)))
+#endif /* __cplusplus */
 
 #endif /* _UTEST_H */
\ No newline at end of file
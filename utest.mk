@@ -3,16 +3,30 @@ UTEST_TEST_DIR?=tests
 UTEST_DIR?=$(UTEST_TEST_DIR)/utest
 UTEST_BIN?=$(UTEST_TEST_DIR)/test
 UTEST_VERSION?=master
+# set to 1 to count heap allocations in each test
+UTEST_TRACK_ALLOCS?=
 
-UTEST_TEST_FILES=$(shell find $(UTEST_TEST_DIR) -not -regex '.*$(UTEST_DIR)/.*' -name '*.c')
-UTEST_TEST_OBJ=$(patsubst %.c,%.o, $(UTEST_TEST_FILES))
+UTEST_TEST_FILES=$(shell find $(UTEST_TEST_DIR) -not -regex '.*$(UTEST_DIR)/.*' \( -name '*.c' -o -name '*.cpp' \))
+UTEST_TEST_OBJ=$(patsubst %.cpp,%.o, $(patsubst %.c,%.o, $(UTEST_TEST_FILES)))
 _UTEST_COMPILE_DEPS=$(patsubst %.h,, $(UTEST_DEPS)) $(UTEST_TEST_DIR)/utest.o
 
+ifneq ($(UTEST_TRACK_ALLOCS),)
+CFLAGS += -DUTEST_TRACK_ALLOCS
+LDFLAGS += -Wl,--wrap=malloc,--wrap=free,--wrap=calloc,--wrap=realloc
+endif
+
+# tests written in c++ need the c++ driver to link
+ifneq ($(filter %.cpp,$(UTEST_TEST_FILES)),)
+_UTEST_LINK=$(LINK.cc)
+else
+_UTEST_LINK=$(LINK.c)
+endif
+
 test: $(UTEST_BIN)
 	@./$(UTEST_BIN)
 
 $(UTEST_BIN): $(_UTEST_COMPILE_DEPS) $(UTEST_TEST_OBJ)
-	$(LINK.c) $(OUTPUT_OPTION) $^
+	$(_UTEST_LINK) $(OUTPUT_OPTION) $^ -pthread
 
 $(UTEST_TEST_OBJ): $(UTEST_TEST_FILES) $(UTEST_TEST_DIR)/utest.o
 